@@ -0,0 +1,152 @@
+#include "entrycache.h"
+
+namespace gpack
+{
+
+static std::shared_ptr<unsigned char> AllocBuffer(uint32_t size)
+{
+	return std::shared_ptr<unsigned char>(new unsigned char[size], std::default_delete<unsigned char[]>());
+}
+
+// Entries whose ReadRaw bytes are compressed data decoding on their own.
+static bool KeepsCompressed(const FileEntry& entry)
+{
+	return entry.header.compression != FileEntry::Header::UNCOMPRESSED
+		&& entry.header.compression != FileEntry::Header::SOLID
+		&& entry.header.compression != FileEntry::Header::CHUNKED;
+}
+
+EntryCache::Tier::Tier(std::size_t _budget)
+	: budget(_budget)
+{
+	stats.hits = 0;
+	stats.misses = 0;
+	stats.evictions = 0;
+	stats.bytes = 0;
+}
+
+bool EntryCache::Tier::Find(const FileEntry* entry, FileView& view)
+{
+	auto it = nodes.find(entry);
+	if (it == nodes.end())
+	{
+		stats.misses++;
+		return false;
+	}
+
+	lru.splice(lru.begin(), lru, it->second);
+	stats.hits++;
+	view = it->second->view;
+	return true;
+}
+
+FileView EntryCache::Tier::Insert(const FileEntry* entry, const FileView& view)
+{
+	if (view.size > budget)
+		return view;
+
+	auto it = nodes.find(entry);
+	if (it != nodes.end())
+		return it->second->view;
+
+	Node node;
+	node.entry = entry;
+	node.view = view;
+	lru.push_front(node);
+	nodes[entry] = lru.begin();
+	stats.bytes += view.size;
+
+	while (stats.bytes > budget && !lru.empty())
+	{
+		Node& last = lru.back();
+		stats.bytes -= last.view.size;
+		stats.evictions++;
+		nodes.erase(last.entry);
+		lru.pop_back();
+	}
+
+	return view;
+}
+
+void EntryCache::Tier::Clear()
+{
+	lru.clear();
+	nodes.clear();
+	stats.bytes = 0;
+}
+
+EntryCache::EntryCache(const FileSystem& _fs, std::size_t _budget, std::size_t _compressed_budget)
+	: fs(_fs)
+	, decompressed(_budget)
+	, compressed(_compressed_budget)
+{
+}
+
+FileView EntryCache::Read(const FileEntry& entry)
+{
+	FileView view;
+	if (fs.View(entry, view))
+		return view;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (decompressed.Find(&entry, view))
+			return view;
+	}
+
+	std::shared_ptr<unsigned char> buffer = AllocBuffer(entry.header.uncompr_size);
+	if (KeepsCompressed(entry) && compressed.budget > 0)
+	{
+		FileView raw = ReadCompressed(entry);
+		fs.Decode(entry, raw.data.get(), buffer.get());
+	}
+	else
+	{
+		fs.Read(entry, buffer.get());
+	}
+
+	view.data = buffer;
+	view.size = entry.header.uncompr_size;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	return decompressed.Insert(&entry, view);
+}
+
+FileView EntryCache::ReadCompressed(const FileEntry& entry)
+{
+	FileView raw;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (compressed.Find(&entry, raw))
+			return raw;
+	}
+
+	std::shared_ptr<unsigned char> buffer = AllocBuffer(entry.header.size);
+	fs.ReadRaw(entry, buffer.get());
+	raw.data = buffer;
+	raw.size = entry.header.size;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	return compressed.Insert(&entry, raw);
+}
+
+void EntryCache::Clear()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	decompressed.Clear();
+	compressed.Clear();
+}
+
+CacheStats EntryCache::Stats() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return decompressed.stats;
+}
+
+CacheStats EntryCache::CompressedStats() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return compressed.stats;
+}
+
+} // namespace gpack
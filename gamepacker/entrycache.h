@@ -0,0 +1,68 @@
+#pragma once
+#include "gamepacker.h"
+
+#include <list>
+#include <unordered_map>
+
+namespace gpack
+{
+
+struct CacheStats
+{
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	std::size_t bytes;
+};
+
+// Keeps recently decompressed entries of a FileSystem under a byte budget.
+// Returned views share ownership of the buffer, so evicting an entry never
+// invalidates a view already handed out. Safe to use from several threads.
+//
+// With a compressed budget, the raw bytes of compressed entries are kept in
+// a second tier, so a miss on the first one only costs an LZ4 decode.
+// Solid and chunked entries bypass it: their raw bytes are the decoded
+// contents or a list of chunks still to be read.
+struct EntryCache
+{
+	EntryCache(const FileSystem& fs, std::size_t budget, std::size_t compressed_budget = 0);
+
+	FileView Read(const FileEntry& entry);
+	void Clear();
+
+	CacheStats Stats() const;
+	CacheStats CompressedStats() const;
+
+private:
+	struct Node
+	{
+		const FileEntry* entry;
+		FileView view;
+	};
+
+	typedef std::list<Node> NodeList;
+
+	struct Tier
+	{
+		std::size_t budget;
+		NodeList lru;
+		std::unordered_map<const FileEntry*, NodeList::iterator> nodes;
+		CacheStats stats;
+
+		explicit Tier(std::size_t budget);
+
+		bool Find(const FileEntry* entry, FileView& view);
+		FileView Insert(const FileEntry* entry, const FileView& view);
+		void Clear();
+	};
+
+	FileView ReadCompressed(const FileEntry& entry);
+
+	const FileSystem& fs;
+
+	mutable std::mutex mutex;
+	Tier decompressed;
+	Tier compressed;
+};
+
+} // namespace gpack
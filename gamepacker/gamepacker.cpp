@@ -1,27 +1,106 @@
 #include "gamepacker.h"
 #include "crcfast.h"
 #include <sstream>
+#include <vector>
+#include <algorithm>
+#include <string.h>
+
+#ifdef _MSC_VER
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include "lz4.h"
 
+struct FopenHandle
+{
+	FILE* file;
+#ifdef _MSC_VER
+	// Opened for overlapped I/O, as Windows serializes every request on a
+	// file object opened for synchronous I/O like the one of file.
+	HANDLE overlapped;
+#endif
+};
+
 int fopen_read(void *_handle, unsigned char *_ptr, int _nbytes)
 {
-	return fread(_ptr, 1, _nbytes, static_cast<FILE*>(_handle));
+	return fread(_ptr, 1, _nbytes, static_cast<FopenHandle*>(_handle)->file);
 }
 
-int fopen_seek(void *_handle, long _offset, int _whence)
+int fopen_seek(void *_handle, int64_t _offset, int _whence)
 {
-	return fseek(static_cast<FILE*>(_handle), _offset, _whence);
+#ifdef _MSC_VER
+	return _fseeki64(static_cast<FopenHandle*>(_handle)->file, _offset, _whence);
+#else
+	return fseeko(static_cast<FopenHandle*>(_handle)->file, (off_t) _offset, _whence);
+#endif
 }
 
-long fopen_tell(void *_handle)
+int64_t fopen_tell(void *_handle)
 {
-	return ftell(static_cast<FILE*>(_handle));
+#ifdef _MSC_VER
+	return _ftelli64(static_cast<FopenHandle*>(_handle)->file);
+#else
+	return (int64_t) ftello(static_cast<FopenHandle*>(_handle)->file);
+#endif
 }
 
 int fopen_close(void *_handle)
 {
-	return fclose(static_cast<FILE*>(_handle));
+	FopenHandle* fh = static_cast<FopenHandle*>(_handle);
+	int result = fclose(fh->file);
+#ifdef _MSC_VER
+	CloseHandle(fh->overlapped);
+#endif
+	delete fh;
+	return result;
+}
+
+int fopen_pread(void *_handle, unsigned char *_ptr, int _nbytes, uint64_t _offset)
+{
+	int total = 0;
+#ifdef _MSC_VER
+	HANDLE file = static_cast<FopenHandle*>(_handle)->overlapped;
+	HANDLE event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (event == NULL)
+		return 0;
+
+	while (total < _nbytes)
+	{
+		OVERLAPPED overlapped;
+		memset(&overlapped, 0, sizeof(overlapped));
+		overlapped.Offset = (DWORD) (_offset + total);
+		overlapped.OffsetHigh = (DWORD) ((_offset + total) >> 32);
+		overlapped.hEvent = event;
+
+		DWORD bytes = 0;
+		if (!ReadFile(file, _ptr + total, _nbytes - total, NULL, &overlapped) && GetLastError() != ERROR_IO_PENDING)
+			break;
+
+		if (!GetOverlappedResult(file, &overlapped, &bytes, TRUE) || bytes == 0)
+			break;
+
+		total += bytes;
+	}
+
+	CloseHandle(event);
+#else
+	int fd = fileno(static_cast<FopenHandle*>(_handle)->file);
+	while (total < _nbytes)
+	{
+		ssize_t bytes = pread(fd, _ptr + total, _nbytes - total, (off_t) (_offset + total));
+		if (bytes <= 0)
+			break;
+
+		total += (int) bytes;
+	}
+#endif
+	return total;
 }
 
 gpack::FileCallbacks fopen_callback = 
@@ -29,12 +108,214 @@ gpack::FileCallbacks fopen_callback =
 	fopen_read,
 	fopen_seek,
 	fopen_tell,
-	fopen_close
+	fopen_close,
+	fopen_pread
+};
+
+struct MemoryHandle
+{
+	const unsigned char* data;
+	int64_t size;
+	int64_t pos;
+};
+
+int memory_read(void *_handle, unsigned char *_ptr, int _nbytes)
+{
+	MemoryHandle* mem = static_cast<MemoryHandle*>(_handle);
+	int64_t avail = mem->size - mem->pos;
+	if (_nbytes > avail)
+		_nbytes = (int) avail;
+
+	memcpy(_ptr, mem->data + mem->pos, _nbytes);
+	mem->pos += _nbytes;
+	return _nbytes;
+}
+
+int memory_seek(void *_handle, int64_t _offset, int _whence)
+{
+	MemoryHandle* mem = static_cast<MemoryHandle*>(_handle);
+	int64_t pos = _offset;
+	if (_whence == SEEK_CUR)
+		pos += mem->pos;
+	else if (_whence == SEEK_END)
+		pos += mem->size;
+
+	if (pos < 0 || pos > mem->size)
+		return -1;
+
+	mem->pos = pos;
+	return 0;
+}
+
+int64_t memory_tell(void *_handle)
+{
+	return static_cast<MemoryHandle*>(_handle)->pos;
+}
+
+int memory_close(void *_handle)
+{
+	delete static_cast<MemoryHandle*>(_handle);
+	return 0;
+}
+
+int memory_pread(void *_handle, unsigned char *_ptr, int _nbytes, uint64_t _offset)
+{
+	MemoryHandle* mem = static_cast<MemoryHandle*>(_handle);
+	if (_offset >= (uint64_t) mem->size)
+		return 0;
+
+	int64_t avail = mem->size - (int64_t) _offset;
+	if (_nbytes > avail)
+		_nbytes = (int) avail;
+
+	memcpy(_ptr, mem->data + _offset, _nbytes);
+	return _nbytes;
+}
+
+gpack::FileCallbacks memory_callback =
+{
+	memory_read,
+	memory_seek,
+	memory_tell,
+	memory_close,
+	memory_pread
 };
 
 namespace gpack
 {
 
+struct MappedFile
+{
+	const unsigned char* data;
+	std::size_t size;
+#ifdef _MSC_VER
+	HANDLE file;
+	HANDLE map;
+#endif
+
+	MappedFile() : data(NULL), size(0)
+	{
+#ifdef _MSC_VER
+		file = INVALID_HANDLE_VALUE;
+		map = NULL;
+#endif
+	}
+
+	~MappedFile()
+	{
+#ifdef _MSC_VER
+		if (data != NULL)
+			UnmapViewOfFile(data);
+		if (map != NULL)
+			CloseHandle(map);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+#else
+		if (data != NULL)
+			munmap((void*) data, size);
+#endif
+	}
+
+	bool Map(const char* path)
+	{
+#ifdef _MSC_VER
+		file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+			return false;
+
+		map = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (map == NULL)
+			return false;
+
+		data = (const unsigned char*) MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+		size = (std::size_t) file_size.QuadPart;
+		return data != NULL;
+#else
+		int fd = open(path, O_RDONLY);
+		if (fd < 0)
+			return false;
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0)
+		{
+			close(fd);
+			return false;
+		}
+
+		void* ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (ptr == MAP_FAILED)
+			return false;
+
+		data = (const unsigned char*) ptr;
+		size = (std::size_t) st.st_size;
+		return true;
+#endif
+	}
+};
+
+// Decodes the stream block at src into out + decoded, using the previous
+// output as dictionary, and advances src past it. Returns the decoded size.
+int DecodeStreamBlock(const unsigned char*& src, const unsigned char* src_end, unsigned char* out, uint32_t decoded, uint32_t remaining)
+{
+	uint32_t block_size;
+	if (src_end - src < (std::ptrdiff_t) sizeof(block_size))
+		return -1;
+
+	memcpy(&block_size, src, sizeof(block_size));
+	src += sizeof(block_size);
+	if ((uint32_t) (src_end - src) < block_size)
+		return -1;
+
+	uint32_t dict_size = std::min(decoded, (uint32_t) FileEntry::StreamWindowSize);
+	uint32_t max_size = std::min(remaining, (uint32_t) FileEntry::StreamBlockSize);
+	int result = LZ4_decompress_safe_usingDict((const char*) src, (char*) out + decoded, block_size, max_size, (const char*) out + decoded - dict_size, dict_size);
+	src += block_size;
+	return result;
+}
+
+uint32_t BlockRawSize(const FileEntry& entry, uint32_t block)
+{
+	return std::min(entry.header.uncompr_size - block * FileEntry::BlockSize, (uint32_t) FileEntry::BlockSize);
+}
+
+// Decodes blocks [first, first + count) of an LZ4HC_BLOCKS entry. table holds
+// their count + 1 offsets and data the entry bytes starting at table[0].
+bool DecodeBlocks(const FileEntry& entry, const unsigned char* table, const unsigned char* data, uint32_t first, uint32_t count, unsigned char* out)
+{
+	uint32_t begin;
+	memcpy(&begin, table, sizeof(begin));
+
+	uint32_t prev = begin;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t next;
+		memcpy(&next, table + (i + 1) * sizeof(next), sizeof(next));
+		if (next < prev || next > entry.header.size)
+			return false;
+
+		uint32_t raw_size = BlockRawSize(entry, first + i);
+		uint32_t size = next - prev;
+		unsigned char* dst = out + i * FileEntry::BlockSize;
+		if (size == raw_size)
+		{
+			memcpy(dst, data + (prev - begin), size);
+		}
+		else if (LZ4_decompress_safe((const char*) data + (prev - begin), (char*) dst, size, raw_size) != (int) raw_size)
+		{
+			return false;
+		}
+
+		prev = next;
+	}
+
+	return true;
+}
+
 std::string HumanizeByteSize(std::size_t bytes)
 {
 	const char* str_mag[] = { "b", "kb", "mb", "gb" };
@@ -52,9 +333,21 @@ std::string HumanizeByteSize(std::size_t bytes)
 	return ss.str();
 }
 
+uint64_t HashPath(const char* path, std::size_t length)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (std::size_t i = 0; i < length; i++)
+	{
+		hash ^= (unsigned char) path[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
 void PrintFileEntry(FileEntry& entry)
 {
-	std::string sub = entry.path.substr(0, 60);
+	std::string sub = std::string(entry.path).substr(0, 60);
 	std::string sz = HumanizeByteSize(entry.header.size);
 	int written = FILEPACKER_LOGV("%s", sub.c_str());
 	for (; written < 60; written++)
@@ -74,7 +367,7 @@ void FilePackerHeader::Init()
 	header[1] = 'p';
 	header[2] = 'a';
 	header[3] = 'k';
-	version = 1;
+	version = FILE_PACKER_VERSION;
 }
 
 bool FilePackerHeader::CheckHeader()
@@ -88,10 +381,10 @@ bool FilePackerHeader::CheckHeader()
 
 bool FilePackerHeader::CheckVersion()
 {
-	return version == 1;
+	return version == FILE_PACKER_VERSION;
 }
 
-FileSystem::FileSystem() : handle(NULL), cb(NULL), data_offset(0)
+FileSystem::FileSystem() : handle(NULL), cb(NULL), dictionary(NULL), dictionary_size(0), data_offset(0), max_compressed_size(0), solid_cache_index(0)
 {
 }
 
@@ -103,7 +396,44 @@ FileSystem::~FileSystem()
 bool FileSystem::Open(const char* _path)
 {
 	FILE* file = fopen(_path, "rb");
-	return Open(file, &fopen_callback);
+	if (file == NULL)
+		return Open(NULL, &fopen_callback);
+
+	FopenHandle* fh = new FopenHandle();
+	fh->file = file;
+#ifdef _MSC_VER
+	fh->overlapped = CreateFileA(_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+	if (fh->overlapped == INVALID_HANDLE_VALUE)
+	{
+		FILEPACKER_LOGE("Unable to open %s for overlapped reads.\n", _path);
+		fclose(file);
+		delete fh;
+		return false;
+	}
+#endif
+	return Open(fh, &fopen_callback);
+}
+
+bool FileSystem::OpenMapped(const char* _path)
+{
+	std::shared_ptr<MappedFile> mapped(new MappedFile());
+	if (!mapped->Map(_path))
+	{
+		FILEPACKER_LOGE("Unable to map %s.\n", _path);
+		return false;
+	}
+
+	MemoryHandle* mem = new MemoryHandle();
+	mem->data = mapped->data;
+	mem->size = (int64_t) mapped->size;
+	mem->pos = 0;
+
+	Close();
+
+	handle = mem;
+	cb = &memory_callback;
+	mapping = mapped;
+	return Load();
 }
 
 bool FileSystem::Open(void* _handle, FileCallbacks* _callbacks)
@@ -114,53 +444,134 @@ bool FileSystem::Open(void* _handle, FileCallbacks* _callbacks)
 
 		handle = _handle;
 		cb = _callbacks;
+		return Load();
+	}
+	else
+	{
+		FILEPACKER_LOGE("File not found.\n");
+		return false;
+	}
+}
+
+bool FileSystem::Load()
+{
+	FilePackerHeader header;
+	cb->read(handle, (unsigned char*)&header, sizeof(FilePackerHeader));
+	if (!header.CheckHeader())
+	{
+		FILEPACKER_LOGE(" - File is not FilePacker file.\n");
+		Close();
+		return false;
+	}
+
+	if (!header.CheckVersion())
+	{
+		FILEPACKER_LOGE(" - File version doesn't match.\n");
+		Close();
+		return false;
+	}
+
+	FilePackerTrailer trailer;
+	int64_t file_size = -1;
+	if (cb->seek(handle, 0, SEEK_END) == 0)
+		file_size = cb->tell(handle);
+
+	if (file_size < (int64_t) (sizeof(FilePackerHeader) + sizeof(FilePackerTrailer))
+		|| cb->seek(handle, file_size - (int64_t) sizeof(FilePackerTrailer), SEEK_SET) != 0
+		|| cb->read(handle, (unsigned char*) &trailer, sizeof(FilePackerTrailer)) != (int) sizeof(FilePackerTrailer))
+	{
+		FILEPACKER_LOGE(" - Unable to read trailer.\n");
+		Close();
+		return false;
+	}
+
+	uint64_t headers_size = (uint64_t) trailer.file_count * sizeof(FileEntry::Header);
+	uint64_t solids_size = (uint64_t) trailer.solid_count * sizeof(SolidBlock);
+	uint64_t chunks_size = (uint64_t) trailer.chunk_count * sizeof(Chunk);
+	uint64_t tables_size = headers_size + solids_size + chunks_size + trailer.dictionary_size;
+	if (tables_size > trailer.toc_size || trailer.toc_offset < sizeof(FilePackerHeader)
+		|| trailer.toc_offset + trailer.toc_size + sizeof(FilePackerTrailer) != (uint64_t) file_size)
+	{
+		FILEPACKER_LOGE(" - Invalid TOC size.\n");
+		Close();
+		return false;
+	}
 
-		FilePackerHeader header;
-		cb->read(handle, (unsigned char*)&header, sizeof(FilePackerHeader));
-		if (!header.CheckHeader())
+	const unsigned char* toc_data = NULL;
+	if (mapping)
+	{
+		toc_data = mapping->data + trailer.toc_offset;
+	}
+	else
+	{
+		toc.resize(trailer.toc_size);
+		if (cb->seek(handle, (int64_t) trailer.toc_offset, SEEK_SET) != 0
+			|| cb->read(handle, toc.data(), (int) trailer.toc_size) != (int) trailer.toc_size)
 		{
-			FILEPACKER_LOGE(" - File is not FilePacker file.\n");
+			FILEPACKER_LOGE(" - Unable to read TOC.\n");
 			Close();
 			return false;
 		}
 
-		if (!header.CheckVersion())
+		toc_data = toc.data();
+	}
+
+	solids.resize(trailer.solid_count);
+	if (trailer.solid_count > 0)
+		memcpy(solids.data(), toc_data + headers_size, (std::size_t) solids_size);
+
+	chunks.resize(trailer.chunk_count);
+	if (trailer.chunk_count > 0)
+		memcpy(chunks.data(), toc_data + headers_size + solids_size, (std::size_t) chunks_size);
+
+	dictionary = toc_data + headers_size + solids_size + chunks_size;
+	dictionary_size = trailer.dictionary_size;
+
+	const char* pool = (const char*) toc_data + tables_size;
+	uint32_t pool_size = trailer.toc_size - (uint32_t) tables_size;
+
+	entries.resize(trailer.file_count);
+	for (uint32_t i = 0; i < trailer.file_count; i++)
+	{
+		FileEntry& entry = entries[i];
+		memcpy(&entry.header, toc_data + i * sizeof(FileEntry::Header), sizeof(FileEntry::Header));
+
+		uint64_t path_end = (uint64_t) entry.header.path_offset + entry.header.path_length;
+		if (entry.header.path_length > FileEntry::MaxPathLength || path_end >= pool_size || pool[path_end] != '\0')
 		{
-			FILEPACKER_LOGE(" - File version doesn't match.\n");
+			FILEPACKER_LOGE("ERROR: Invalid path for file %u.\n", i);
 			Close();
 			return false;
 		}
 
-		for (std::size_t i = 0; i < header.file_count; i++)
-		{
-			FileEntry entry;
-			cb->read(handle, (unsigned char*) &entry.header, sizeof(entry.header));
-
-			uint32_t length;
-			cb->read(handle, (unsigned char*)&length, sizeof(length));
+		entry.path = pool + entry.header.path_offset;
 
-			if (length > FileEntry::MaxPathLength)
+		if (entry.header.compression == FileEntry::Header::SOLID)
+		{
+			if (entry.header.solid >= trailer.solid_count || (uint64_t) entry.header.offset + entry.header.uncompr_size > solids[entry.header.solid].uncompr_size)
 			{
-				FILEPACKER_LOGE("ERROR: Invalid lenght file %d.\n", i);
-				length = FileEntry::MaxPathLength;
+				FILEPACKER_LOGE("ERROR: Invalid solid block for file %s.\n", entry.path);
+				Close();
+				return false;
 			}
 
-			char buffer[FileEntry::MaxPathLength];
-			cb->read(handle, (unsigned char*)buffer, length);
-			buffer[length] = '\0';
-			entry.path = buffer;
+			continue;
+		}
 
-			entries[entry.path] = entry;
+		if (entry.header.compression == FileEntry::Header::CHUNKED && entry.header.size % sizeof(uint32_t) != 0)
+		{
+			FILEPACKER_LOGE("ERROR: Invalid chunk list for file %s.\n", entry.path);
+			Close();
+			return false;
 		}
 
-		data_offset = cb->tell(handle);
-	}
-	else
-	{
-		FILEPACKER_LOGE("File not found.\n");
-		return false;
+		if (entry.header.compression != FileEntry::Header::UNCOMPRESSED && entry.header.size > max_compressed_size)
+			max_compressed_size = entry.header.size;
 	}
 
+	BuildIndex();
+
+	data_offset = sizeof(FilePackerHeader);
 	return true;
 }
 
@@ -176,67 +587,929 @@ void FileSystem::Close()
 		
 		cb = NULL;
 		entries.clear();
+		solids.clear();
+		chunks.clear();
+		dictionary = NULL;
+		dictionary_size = 0;
+		solid_cache.reset();
+		index.clear();
+		toc.clear();
 		data_offset = 0;
+		max_compressed_size = 0;
+		mapping.reset();
+
+		for (std::size_t i = 0; i < scratch_pool.size(); i++)
+			delete[] scratch_pool[i];
+
+		scratch_pool.clear();
 	}
 }
 
-void FileSystem::Read(const FileEntry& entry, unsigned char* out) const
+const unsigned char* FileSystem::MappedData(const FileEntry& entry, uint32_t size) const
 {
-	cb->seek(handle, data_offset + entry.header.offset, SEEK_SET);
-	if (entry.header.compression == FileEntry::Header::LZ4HC)
+	const unsigned char* data = MappedRange(entry.header.offset, size);
+	if (data == NULL)
 	{
-		unsigned char* buffer = new unsigned char[entry.header.size];
-		cb->read(handle, buffer, entry.header.size);
-		int result = LZ4_decompress_safe((const char*) buffer, (char*) out, entry.header.size, entry.header.uncompr_size);
-		delete[] buffer;
+		FILEPACKER_LOGE("File %s is out of mapped range.\n", entry.path);
+	}
 
-		if (result < 0)
+	return data;
+}
+
+const unsigned char* FileSystem::MappedRange(uint64_t offset, uint32_t size) const
+{
+	uint64_t begin = (uint64_t) data_offset + offset;
+	if (begin + size > mapping->size)
+		return NULL;
+
+	return mapping->data + begin;
+}
+
+void FileSystem::ReadSolid(const FileEntry& entry, uint32_t offset, uint32_t length, unsigned char* out) const
+{
+	if (length == 0)
+		return;
+
+	std::shared_ptr<std::vector<unsigned char> > block;
+	{
+		std::lock_guard<std::mutex> lock(solid_mutex);
+		if (solid_cache && solid_cache_index == entry.header.solid)
+			block = solid_cache;
+	}
+
+	if (!block)
+	{
+		const SolidBlock& solid = solids[entry.header.solid];
+		block = std::make_shared<std::vector<unsigned char> >(solid.uncompr_size);
+
+		std::vector<unsigned char> input;
+		const unsigned char* src = NULL;
+		if (mapping)
 		{
-			FILEPACKER_LOGE("Error decompressing file");
+			src = MappedRange(solid.offset, solid.size);
+		}
+		else
+		{
+			input.resize(solid.size);
+			if (ReadAt(input.data(), solid.size, (uint64_t) data_offset + solid.offset) == (int) solid.size)
+				src = input.data();
+		}
+
+		if (src == NULL)
+		{
+			FILEPACKER_LOGE("Error reading solid block %u.\n", entry.header.solid);
+			return;
+		}
+
+		if (solid.size == solid.uncompr_size)
+		{
+			memcpy(block->data(), src, solid.size);
+		}
+		else if (LZ4_decompress_safe((const char*) src, (char*) block->data(), solid.size, solid.uncompr_size) != (int) solid.uncompr_size)
+		{
+			FILEPACKER_LOGE("Error decompressing solid block %u.\n", entry.header.solid);
+			return;
 		}
+
+		std::lock_guard<std::mutex> lock(solid_mutex);
+		solid_cache = block;
+		solid_cache_index = entry.header.solid;
+	}
+
+	memcpy(out, block->data() + entry.header.offset + offset, length);
+}
+
+void FileSystem::Read(const FileEntry& entry, unsigned char* out) const
+{
+	if (entry.header.compression == FileEntry::Header::SOLID)
+	{
+		ReadSolid(entry, 0, entry.header.uncompr_size, out);
+		return;
+	}
+
+	if (mapping)
+	{
+		const unsigned char* src = MappedData(entry, entry.header.size);
+		if (src != NULL)
+			Decode(entry, src, out);
+
+		return;
+	}
+
+	if (entry.header.compression != FileEntry::Header::UNCOMPRESSED)
+	{
+		unsigned char* scratch = AcquireScratch();
+		Read(entry, out, scratch);
+		ReleaseScratch(scratch);
 	}
 	else
 	{
-		cb->read(handle, out, entry.header.uncompr_size);
+		Read(entry, out, NULL);
 	}
 }
 
-void FileSystem::ReadRaw(const FileEntry& entry, unsigned char* out) const
+void FileSystem::Read(const FileEntry& entry, unsigned char* out, unsigned char* scratch) const
 {
-	cb->seek(handle, data_offset + entry.header.offset, SEEK_SET);
-	cb->read(handle, out, entry.header.size);
+	if (entry.header.compression == FileEntry::Header::SOLID)
+	{
+		ReadSolid(entry, 0, entry.header.uncompr_size, out);
+		return;
+	}
+
+	if (mapping)
+	{
+		Read(entry, out);
+		return;
+	}
+
+	uint64_t offset = (uint64_t) data_offset + entry.header.offset;
+	if (entry.header.compression != FileEntry::Header::UNCOMPRESSED)
+	{
+		ReadAt(scratch, entry.header.size, offset);
+		Decode(entry, scratch, out);
+	}
+	else
+	{
+		ReadAt(out, entry.header.uncompr_size, offset);
+	}
 }
 
-const FileSystem::EntryMap& FileSystem::Entries() const
+uint32_t FileSystem::ScratchSize() const
 {
-	return entries;
+	return max_compressed_size;
 }
 
-void TestFile(const char* path)
+void FileSystem::ReadInPlace(const FileEntry& entry, unsigned char* out) const
 {
-	FileSystem fs;
-	if (fs.Open(path))
+	if (mapping || (entry.header.compression != FileEntry::Header::LZ4HC && entry.header.compression != FileEntry::Header::LZ4))
 	{
-		auto it = fs.Entries().begin();
-		for (; it != fs.Entries().end(); it++)
-		{
-			const FileEntry& entry = it->second;
-			unsigned char* buffer = new unsigned char[entry.header.size];
-			fs.ReadRaw(entry, buffer);
+		Read(entry, out);
+		return;
+	}
+
+	unsigned char* src = out + InPlaceSize(entry) - entry.header.size;
+	ReadAt(src, entry.header.size, (uint64_t) data_offset + entry.header.offset);
+	Decode(entry, src, out);
+}
+
+uint32_t FileSystem::InPlaceSize(const FileEntry& entry) const
+{
+	if (entry.header.compression == FileEntry::Header::LZ4HC || entry.header.compression == FileEntry::Header::LZ4)
+		return entry.header.uncompr_size + entry.header.inplace_margin;
+
+	return entry.header.uncompr_size;
+}
+
+void FileSystem::ReadRaw(const FileEntry& entry, unsigned char* out) const
+{
+	if (entry.header.compression == FileEntry::Header::SOLID)
+	{
+		ReadSolid(entry, 0, entry.header.uncompr_size, out);
+		return;
+	}
+
+	if (mapping)
+	{
+		const unsigned char* src = MappedData(entry, entry.header.size);
+		if (src != NULL)
+			memcpy(out, src, entry.header.size);
+
+		return;
+	}
+
+	ReadAt(out, entry.header.size, (uint64_t) data_offset + entry.header.offset);
+}
+
+void FileSystem::ReadBatch(ReadRequest* requests, std::size_t count, uint32_t max_gap) const
+{
+	if (mapping)
+	{
+		for (std::size_t i = 0; i < count; i++)
+			Read(*requests[i].entry, requests[i].out);
+
+		return;
+	}
+
+	// Entries inside a solid block are served from the decoded block, grouped
+	// by block so each one is decoded once.
+	std::vector<std::size_t> order;
+	std::vector<std::size_t> solid_order;
+	order.reserve(count);
+	for (std::size_t i = 0; i < count; i++)
+	{
+		if (requests[i].entry->header.compression == FileEntry::Header::SOLID)
+			solid_order.push_back(i);
+		else
+			order.push_back(i);
+	}
+
+	std::sort(solid_order.begin(), solid_order.end(), [requests](std::size_t a, std::size_t b) {
+		return requests[a].entry->header.solid < requests[b].entry->header.solid;
+	});
+
+	for (std::size_t i = 0; i < solid_order.size(); i++)
+		Read(*requests[solid_order[i]].entry, requests[solid_order[i]].out);
+
+	std::sort(order.begin(), order.end(), [requests](std::size_t a, std::size_t b) {
+		return requests[a].entry->header.offset < requests[b].entry->header.offset;
+	});
+
+	count = order.size();
+
+	std::vector<unsigned char> staging;
+	std::size_t first = 0;
+	while (first < count)
+	{
+		const FileEntry::Header& head = requests[order[first]].entry->header;
+		uint64_t run_begin = head.offset;
+		uint64_t run_end = run_begin + head.size;
+
+		std::size_t last = first + 1;
+		for (; last < count; last++)
+		{
+			const FileEntry::Header& next = requests[order[last]].entry->header;
+			uint64_t next_end = std::max(run_end, (uint64_t) next.offset + next.size);
+			if (next.offset > run_end + max_gap || next_end - run_begin > MaxBatchRun)
+				break;
+
+			run_end = next_end;
+		}
+
+		if (last - first == 1)
+		{
+			Read(*requests[order[first]].entry, requests[order[first]].out);
+		}
+		else
+		{
+			staging.resize((std::size_t) (run_end - run_begin));
+			ReadAt(staging.data(), (uint32_t) staging.size(), data_offset + run_begin);
+			for (std::size_t i = first; i < last; i++)
+			{
+				const ReadRequest& request = requests[order[i]];
+				Decode(*request.entry, staging.data() + (request.entry->header.offset - run_begin), request.out);
+			}
+		}
+
+		first = last;
+	}
+}
+
+void FileSystem::Decode(const FileEntry& entry, const unsigned char* src, unsigned char* out) const
+{
+	if (entry.header.compression == FileEntry::Header::LZ4HC || entry.header.compression == FileEntry::Header::LZ4)
+	{
+		int result = LZ4_decompress_safe((const char*) src, (char*) out, entry.header.size, entry.header.uncompr_size);
+		if (result < 0)
+		{
+			FILEPACKER_LOGE("Error decompressing file");
+		}
+	}
+	else if (entry.header.compression == FileEntry::Header::LZ4HC_STREAM)
+	{
+		const unsigned char* src_end = src + entry.header.size;
+		uint32_t decoded = 0;
+		while (decoded < entry.header.uncompr_size)
+		{
+			int result = DecodeStreamBlock(src, src_end, out, decoded, entry.header.uncompr_size - decoded);
+			if (result <= 0)
+			{
+				FILEPACKER_LOGE("Error decompressing file");
+				break;
+			}
+
+			decoded += result;
+		}
+	}
+	else if (entry.header.compression == FileEntry::Header::LZ4HC_BLOCKS)
+	{
+		uint32_t count = BlockCount(entry);
+		uint32_t begin = 0;
+		if ((count + 1) * sizeof(uint32_t) <= entry.header.size)
+			memcpy(&begin, src, sizeof(begin));
+
+		if (begin == 0 || begin > entry.header.size || !DecodeBlocks(entry, src, src + begin, 0, count, out))
+		{
+			FILEPACKER_LOGE("Error decompressing file");
+		}
+	}
+	else if (entry.header.compression == FileEntry::Header::CHUNKED)
+	{
+		DecodeChunks(entry, src, out);
+	}
+	else if (entry.header.compression == FileEntry::Header::LZ4HC_DICT)
+	{
+		int result = LZ4_decompress_safe_usingDict((const char*) src, (char*) out, entry.header.size, entry.header.uncompr_size, (const char*) dictionary, dictionary_size);
+		if (result < 0)
+		{
+			FILEPACKER_LOGE("Error decompressing file");
+		}
+	}
+	else
+	{
+		memcpy(out, src, entry.header.uncompr_size);
+	}
+}
+
+void FileSystem::DecodeChunks(const FileEntry& entry, const unsigned char* src, unsigned char* out) const
+{
+	std::vector<unsigned char> input;
+	uint32_t count = entry.header.size / sizeof(uint32_t);
+	uint32_t decoded = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t index = 0;
+		memcpy(&index, src + i * sizeof(uint32_t), sizeof(index));
+		if (index >= chunks.size() || chunks[index].uncompr_size > entry.header.uncompr_size - decoded)
+		{
+			FILEPACKER_LOGE("Invalid chunk %u in file %s.\n", index, entry.path);
+			return;
+		}
+
+		const Chunk& chunk = chunks[index];
+		const unsigned char* data = NULL;
+		if (mapping)
+		{
+			data = MappedRange(chunk.offset, chunk.size);
+		}
+		else
+		{
+			input.resize(chunk.size);
+			if (ReadAt(input.data(), chunk.size, (uint64_t) data_offset + chunk.offset) == (int) chunk.size)
+				data = input.data();
+		}
+
+		if (data == NULL)
+		{
+			FILEPACKER_LOGE("Error reading chunk %u.\n", index);
+			return;
+		}
+
+		if (chunk.size == chunk.uncompr_size)
+		{
+			memcpy(out + decoded, data, chunk.size);
+		}
+		else if (LZ4_decompress_safe((const char*) data, (char*) out + decoded, chunk.size, chunk.uncompr_size) != (int) chunk.uncompr_size)
+		{
+			FILEPACKER_LOGE("Error decompressing chunk %u.\n", index);
+			return;
+		}
+
+		decoded += chunk.uncompr_size;
+	}
+
+	if (decoded != entry.header.uncompr_size)
+	{
+		FILEPACKER_LOGE("Chunks of file %s do not add up to its size.\n", entry.path);
+	}
+}
+
+uint32_t FileSystem::ReadRange(const FileEntry& entry, uint32_t offset, uint32_t length, unsigned char* out) const
+{
+	if (offset >= entry.header.uncompr_size)
+		return 0;
+
+	length = std::min(length, entry.header.uncompr_size - offset);
+	if (length == 0)
+		return 0;
+
+	if (entry.header.compression == FileEntry::Header::UNCOMPRESSED)
+	{
+		int result = ReadAt(out, length, (uint64_t) data_offset + entry.header.offset + offset);
+		return result > 0 ? result : 0;
+	}
+
+	if (entry.header.compression == FileEntry::Header::LZ4HC || entry.header.compression == FileEntry::Header::LZ4)
+	{
+		if (offset == 0)
+			return DecodePrefix(entry, length, out);
+
+		std::vector<unsigned char> prefix(offset + length);
+		uint32_t result = DecodePrefix(entry, offset + length, prefix.data());
+		if (result <= offset)
+			return 0;
+
+		memcpy(out, prefix.data() + offset, result - offset);
+		return result - offset;
+	}
+
+	if (entry.header.compression == FileEntry::Header::SOLID)
+	{
+		ReadSolid(entry, offset, length, out);
+		return length;
+	}
+
+	if (entry.header.compression != FileEntry::Header::LZ4HC_BLOCKS)
+	{
+		FileStream stream;
+		stream.Open(*this, entry);
+		stream.Seek(offset);
+		return stream.Read(out, length);
+	}
+
+	uint32_t end = offset + length;
+	uint32_t block = offset / FileEntry::BlockSize;
+	uint32_t last = (end - 1) / FileEntry::BlockSize;
+	std::vector<unsigned char> partial;
+	while (block <= last)
+	{
+		uint32_t block_begin = block * FileEntry::BlockSize;
+		uint32_t block_end = block_begin + BlockRawSize(entry, block);
+		if (offset > block_begin || end < block_end)
+		{
+			partial.resize(FileEntry::BlockSize);
+			ReadBlocks(entry, block, 1, partial.data());
+
+			uint32_t copy_begin = std::max(offset, block_begin);
+			uint32_t copy_end = std::min(end, block_end);
+			memcpy(out + (copy_begin - offset), partial.data() + (copy_begin - block_begin), copy_end - copy_begin);
+			block++;
+			continue;
+		}
+
+		uint32_t count = 1;
+		while (block + count <= last && (block + count + 1) * FileEntry::BlockSize <= end)
+			count++;
+
+		if (block + count == last && end == entry.header.uncompr_size)
+			count++;
+
+		ReadBlocks(entry, block, count, out + (block_begin - offset));
+		block += count;
+	}
+
+	return length;
+}
+
+uint32_t FileSystem::ReadPrefix(const FileEntry& entry, uint32_t size, unsigned char* out) const
+{
+	return ReadRange(entry, 0, size, out);
+}
+
+uint32_t FileSystem::DecodePrefix(const FileEntry& entry, uint32_t size, unsigned char* out) const
+{
+	size = std::min(size, entry.header.uncompr_size);
+	if (size == entry.header.uncompr_size)
+	{
+		Read(entry, out);
+		return size;
+	}
+
+	// Decoding stops once size bytes are out, but the sequence crossing that
+	// point is completed, so give it room and only read the compressed bytes
+	// that can possibly be needed. A longer sequence makes the first attempt
+	// fail, in which case the whole input and output space is used.
+	uint32_t capacity = std::min(entry.header.uncompr_size, std::max(size * 2, size + 64 * 1024));
+	uint32_t input_size = std::min(entry.header.size, (uint32_t) LZ4_COMPRESSBOUND(capacity));
+
+	std::vector<unsigned char> output;
+	std::vector<unsigned char> input;
+	const unsigned char* src = NULL;
+	if (mapping)
+	{
+		src = MappedData(entry, entry.header.size);
+		if (src == NULL)
+			return 0;
+	}
+
+	int result = -1;
+	for (int attempt = 0; attempt < 2 && result < (int) size; attempt++)
+	{
+		if (attempt > 0)
+		{
+			capacity = entry.header.uncompr_size;
+			input_size = entry.header.size;
+		}
+
+		if (!mapping)
+		{
+			input.resize(input_size);
+			ReadAt(input.data(), input_size, (uint64_t) data_offset + entry.header.offset);
+			src = input.data();
+		}
+
+		output.resize(capacity);
+		result = LZ4_decompress_safe_partial((const char*) src, (char*) output.data(), input_size, size, capacity);
+	}
+
+	if (result < (int) size)
+	{
+		FILEPACKER_LOGE("Error decompressing file");
+		return 0;
+	}
+
+	memcpy(out, output.data(), size);
+	return size;
+}
+
+uint32_t FileSystem::BlockCount(const FileEntry& entry) const
+{
+	if (entry.header.compression != FileEntry::Header::LZ4HC_BLOCKS)
+		return 1;
+
+	return (uint32_t) (((uint64_t) entry.header.uncompr_size + FileEntry::BlockSize - 1) / FileEntry::BlockSize);
+}
+
+void FileSystem::ReadBlocks(const FileEntry& entry, uint32_t first, uint32_t count, unsigned char* out) const
+{
+	if (entry.header.compression != FileEntry::Header::LZ4HC_BLOCKS)
+	{
+		if (first == 0 && count > 0)
+			Read(entry, out);
+
+		return;
+	}
+
+	if (count == 0 || first + count > BlockCount(entry))
+		return;
+
+	if ((uint64_t) (first + count + 1) * sizeof(uint32_t) > entry.header.size)
+	{
+		FILEPACKER_LOGE("Error decompressing file");
+		return;
+	}
+
+	const unsigned char* table = NULL;
+	const unsigned char* data = NULL;
+	std::vector<uint32_t> table_buffer;
+	std::vector<unsigned char> data_buffer;
+
+	if (mapping)
+	{
+		const unsigned char* src = MappedData(entry, entry.header.size);
+		if (src == NULL)
+			return;
+
+		table = src + first * sizeof(uint32_t);
+		uint32_t begin;
+		memcpy(&begin, table, sizeof(begin));
+		if (begin > entry.header.size)
+		{
+			FILEPACKER_LOGE("Error decompressing file");
+			return;
+		}
+
+		data = src + begin;
+	}
+	else
+	{
+		uint64_t base = (uint64_t) data_offset + entry.header.offset;
+		table_buffer.resize(count + 1);
+		ReadAt((unsigned char*) table_buffer.data(), (count + 1) * sizeof(uint32_t), base + first * sizeof(uint32_t));
+		if (table_buffer[0] > table_buffer[count] || table_buffer[count] > entry.header.size)
+		{
+			FILEPACKER_LOGE("Error decompressing file");
+			return;
+		}
+
+		data_buffer.resize(table_buffer[count] - table_buffer[0]);
+		ReadAt(data_buffer.data(), (uint32_t) data_buffer.size(), base + table_buffer[0]);
+		table = (const unsigned char*) table_buffer.data();
+		data = data_buffer.data();
+	}
+
+	if (!DecodeBlocks(entry, table, data, first, count, out))
+	{
+		FILEPACKER_LOGE("Error decompressing file");
+	}
+}
+
+unsigned char* FileSystem::AcquireScratch() const
+{
+	{
+		std::lock_guard<std::mutex> lock(scratch_mutex);
+		if (!scratch_pool.empty())
+		{
+			unsigned char* scratch = scratch_pool.back();
+			scratch_pool.pop_back();
+			return scratch;
+		}
+	}
+
+	return new unsigned char[max_compressed_size];
+}
+
+void FileSystem::ReleaseScratch(unsigned char* scratch) const
+{
+	std::lock_guard<std::mutex> lock(scratch_mutex);
+	scratch_pool.push_back(scratch);
+}
+
+int FileSystem::ReadAt(unsigned char* out, uint32_t size, uint64_t offset) const
+{
+	if (cb->pread != NULL)
+		return cb->pread(handle, out, (int) size, offset);
+
+	std::lock_guard<std::mutex> lock(io_mutex);
+	cb->seek(handle, (int64_t) offset, SEEK_SET);
+	return cb->read(handle, out, (int) size);
+}
+
+bool FileSystem::View(const FileEntry& entry, FileView& view) const
+{
+	if (!mapping || entry.header.compression != FileEntry::Header::UNCOMPRESSED)
+		return false;
+
+	const unsigned char* src = MappedData(entry, entry.header.size);
+	if (src == NULL)
+		return false;
+
+	view.data = std::shared_ptr<const unsigned char>(mapping, src);
+	view.size = entry.header.size;
+	return true;
+}
+
+bool FileSystem::IsMapped() const
+{
+	return mapping.get() != NULL;
+}
+
+const FileSystem::EntryList& FileSystem::Entries() const
+{
+	return entries;
+}
+
+const FileEntry* FileSystem::Find(const char* path) const
+{
+	return Find(path, strlen(path));
+}
+
+const FileEntry* FileSystem::Find(const std::string& path) const
+{
+	return Find(path.data(), path.length());
+}
+
+const FileEntry* FileSystem::Find(const char* path, std::size_t length) const
+{
+	if (index.empty())
+		return NULL;
+
+	uint64_t hash = HashPath(path, length);
+	std::size_t mask = index.size() - 1;
+	for (std::size_t slot = (std::size_t) hash & mask; index[slot].entry != UINT32_MAX; slot = (slot + 1) & mask)
+	{
+		if (index[slot].hash == hash)
+		{
+			const FileEntry& entry = entries[index[slot].entry];
+			if (entry.header.path_length == length && memcmp(entry.path, path, length) == 0)
+				return &entry;
+		}
+	}
+
+	return NULL;
+}
+
+void FileSystem::BuildIndex()
+{
+	std::size_t capacity = 16;
+	while (capacity < entries.size() * 2)
+		capacity *= 2;
+
+	IndexSlot empty = { 0, UINT32_MAX };
+	index.assign(capacity, empty);
+
+	std::size_t mask = capacity - 1;
+	for (uint32_t i = 0; i < (uint32_t) entries.size(); i++)
+	{
+		const FileEntry& entry = entries[i];
+		uint64_t hash = HashPath(entry.path, entry.header.path_length);
+		std::size_t slot = (std::size_t) hash & mask;
+		for (; index[slot].entry != UINT32_MAX; slot = (slot + 1) & mask)
+		{
+			const FileEntry& other = entries[index[slot].entry];
+			if (index[slot].hash == hash && other.header.path_length == entry.header.path_length && memcmp(other.path, entry.path, entry.header.path_length) == 0)
+				break;
+		}
+
+		index[slot].hash = hash;
+		index[slot].entry = i;
+	}
+}
+
+FileStream::FileStream()
+	: fs(NULL)
+	, entry(NULL)
+	, position(0)
+	, window_used(0)
+	, block_begin(0)
+	, block_position(0)
+	, block_size(0)
+	, next_raw(0)
+	, next_raw_size(0)
+{
+}
+
+bool FileStream::Open(const FileSystem& _fs, const FileEntry& _entry)
+{
+	Close();
+
+	fs = &_fs;
+	entry = &_entry;
+
+	if (entry->header.compression == FileEntry::Header::LZ4HC_STREAM)
+	{
+		window.resize(FileEntry::StreamWindowSize + FileEntry::StreamBlockSize);
+		Rewind();
+	}
+	else if (entry->header.compression == FileEntry::Header::LZ4HC_BLOCKS)
+	{
+		window.resize(FileEntry::BlockSize);
+		Rewind();
+	}
+	else if (entry->header.compression != FileEntry::Header::UNCOMPRESSED)
+	{
+		window.resize(entry->header.uncompr_size);
+		fs->Read(*entry, window.data());
+		block_size = entry->header.uncompr_size;
+	}
+
+	return true;
+}
+
+void FileStream::Close()
+{
+	fs = NULL;
+	entry = NULL;
+	position = 0;
+	window.clear();
+	input.clear();
+	Rewind();
+}
+
+uint32_t FileStream::Read(unsigned char* out, uint32_t size)
+{
+	if (entry == NULL)
+		return 0;
+
+	size = std::min(size, entry->header.uncompr_size - position);
+	if (entry->header.compression == FileEntry::Header::UNCOMPRESSED)
+	{
+		int result = fs->ReadAt(out, size, (uint64_t) fs->data_offset + entry->header.offset + position);
+		if (result <= 0)
+			return 0;
+
+		position += result;
+		return result;
+	}
+
+	uint32_t copied = 0;
+	while (copied < size)
+	{
+		if (position < block_position || position >= block_position + block_size)
+		{
+			if (!DecodeNext())
+				break;
+
+			continue;
+		}
+
+		uint32_t count = std::min(block_position + block_size - position, size - copied);
+		memcpy(out + copied, window.data() + block_begin + (position - block_position), count);
+		copied += count;
+		position += count;
+	}
+
+	return copied;
+}
+
+bool FileStream::Seek(uint32_t _position)
+{
+	if (entry == NULL || _position > entry->header.uncompr_size)
+		return false;
+
+	if (entry->header.compression == FileEntry::Header::LZ4HC_STREAM && _position < block_position)
+		Rewind();
+
+	position = _position;
+	return true;
+}
+
+uint32_t FileStream::Tell() const
+{
+	return position;
+}
+
+uint32_t FileStream::Size() const
+{
+	return entry != NULL ? entry->header.uncompr_size : 0;
+}
+
+void FileStream::Rewind()
+{
+	window_used = 0;
+	block_begin = 0;
+	block_position = 0;
+	block_size = 0;
+	next_raw = 0;
+	next_raw_size = 0;
+}
+
+bool FileStream::DecodeNext()
+{
+	if (entry->header.compression == FileEntry::Header::LZ4HC_BLOCKS)
+	{
+		uint32_t block = position / FileEntry::BlockSize;
+		if (block >= fs->BlockCount(*entry))
+			return false;
+
+		fs->ReadBlocks(*entry, block, 1, window.data());
+		block_begin = 0;
+		block_position = block * FileEntry::BlockSize;
+		block_size = BlockRawSize(*entry, block);
+		return true;
+	}
+
+	uint32_t next_position = block_position + block_size;
+	if (entry->header.compression != FileEntry::Header::LZ4HC_STREAM || next_position >= entry->header.uncompr_size)
+		return false;
+
+	uint64_t base = (uint64_t) fs->data_offset + entry->header.offset;
+	if (next_raw_size == 0)
+	{
+		if (fs->ReadAt((unsigned char*) &next_raw_size, sizeof(next_raw_size), base + next_raw) != sizeof(next_raw_size))
+			return false;
+
+		next_raw += sizeof(next_raw_size);
+	}
+
+	// Each read also fetches the size of the following block.
+	uint64_t payload_end = (uint64_t) next_raw + next_raw_size;
+	if (payload_end > entry->header.size)
+	{
+		FILEPACKER_LOGE("Error decompressing file");
+		return false;
+	}
+
+	bool has_next = payload_end + sizeof(next_raw_size) <= entry->header.size;
+	input.resize(next_raw_size + (has_next ? sizeof(next_raw_size) : 0));
+	if (fs->ReadAt(input.data(), (uint32_t) input.size(), base + next_raw) != (int) input.size())
+		return false;
+
+	if (window_used + FileEntry::StreamBlockSize > window.size())
+	{
+		uint32_t keep = std::min(window_used, (uint32_t) FileEntry::StreamWindowSize);
+		memmove(window.data(), window.data() + window_used - keep, keep);
+		window_used = keep;
+	}
+
+	uint32_t dict_size = std::min(window_used, (uint32_t) FileEntry::StreamWindowSize);
+	uint32_t max_size = std::min(entry->header.uncompr_size - next_position, (uint32_t) FileEntry::StreamBlockSize);
+	unsigned char* dst = window.data() + window_used;
+	int result = LZ4_decompress_safe_usingDict((const char*) input.data(), (char*) dst, next_raw_size, max_size, (const char*) dst - dict_size, dict_size);
+	if (result <= 0)
+	{
+		FILEPACKER_LOGE("Error decompressing file");
+		return false;
+	}
+
+	block_begin = window_used;
+	block_position = next_position;
+	block_size = result;
+	window_used += result;
+
+	next_raw = (uint32_t) payload_end;
+	if (has_next)
+	{
+		memcpy(&next_raw_size, input.data() + next_raw_size, sizeof(next_raw_size));
+		next_raw += sizeof(next_raw_size);
+	}
+	else
+	{
+		next_raw_size = 0;
+	}
+
+	return true;
+}
+
+void TestFile(const char* path)
+{
+	FileSystem fs;
+	if (fs.Open(path))
+	{
+		auto it = fs.Entries().begin();
+		for (; it != fs.Entries().end(); it++)
+		{
+			const FileEntry& entry = *it;
+			bool chunked = entry.header.compression == FileEntry::Header::CHUNKED;
+			uint32_t size = chunked ? entry.header.uncompr_size : entry.header.size;
+			unsigned char* buffer = new unsigned char[size];
+			if (chunked)
+				fs.Read(entry, buffer);
+			else
+				fs.ReadRaw(entry, buffer);
 
 			crcFast crc;
-			for (size_t i = 0; i < entry.header.size; i++)
+			for (size_t i = 0; i < size; i++)
 				crc.Append(buffer[i]);
 
 			delete[] buffer;
 			unsigned short expected = crc.CRC();
 			if (entry.header.crc == expected)
 			{
-				FILEPACKER_LOGV(" + File %s CRC(%d) is OK.\n", entry.path.c_str(), entry.header.crc);
+				FILEPACKER_LOGV(" + File %s CRC(%d) is OK.\n", entry.path, entry.header.crc);
 			}
 			else
 			{
-				FILEPACKER_LOGE(" - File %s CRC(%d) is WRONG. Expected: %d\n", entry.path.c_str(), entry.header.crc, expected);
+				FILEPACKER_LOGE(" - File %s CRC(%d) is WRONG. Expected: %d\n", entry.path, entry.header.crc, expected);
 			}
 		}
 	}
@@ -2,7 +2,9 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string>
-#include <map>
+#include <vector>
+#include <memory>
+#include <mutex>
 
 #ifndef FILEPACKER_LOGV
 #define FILEPACKER_LOGV(...) fprintf(stdout, __VA_ARGS__)
@@ -16,22 +18,37 @@ namespace gpack
 {
 
 #define FILE_PACKER_HEADER_SIZE 4
+#define FILE_PACKER_VERSION 12
 
+// A pack is this header, the entry data, the TOC and a FilePackerTrailer, so
+// the builder can write every entry as soon as it is compressed.
 struct FilePackerHeader
 {
 	uint8_t header[FILE_PACKER_HEADER_SIZE];
 	uint32_t version;
-	uint32_t file_count;
 
 	void Init();
 	bool CheckHeader();
 	bool CheckVersion();
 };
 
+struct FilePackerTrailer
+{
+	uint64_t toc_offset;
+	uint32_t file_count;
+	uint32_t solid_count;
+	uint32_t chunk_count;
+	uint32_t dictionary_size;
+	uint32_t toc_size;
+	uint32_t unused;
+};
+
 typedef int(*read_func)(void *_handle, unsigned char *_ptr, int _nbytes);
-typedef int(*seek_func)(void *_handle, long _offset, int _whence);
-typedef long(*tell_func)(void *_handle);
+// Offsets are 64 bits, as long is 32 bits on Windows and packs can be larger.
+typedef int(*seek_func)(void *_handle, int64_t _offset, int _whence);
+typedef int64_t(*tell_func)(void *_handle);
 typedef int(*close_func)(void *_handle);
+typedef int(*pread_func)(void *_handle, unsigned char *_ptr, int _nbytes, uint64_t _offset);
 
 struct FileCallbacks
 {
@@ -39,36 +56,118 @@ struct FileCallbacks
 	seek_func  seek;
 	tell_func  tell;
 	close_func close;
+
+	// Optional. Reads at an absolute offset without touching the handle
+	// position. Without it entry reads are serialized through seek + read.
+	pread_func pread;
 };
 
 struct FileEntry
 {
 	enum
 	{
-		MaxPathLength = 1024
+		MaxPathLength = 1024,
+
+		// LZ4HC_STREAM entries are a sequence of [uint32 size][block], every
+		// block but the last one decoding to StreamBlockSize bytes and using
+		// the previous StreamWindowSize decoded bytes as dictionary.
+		StreamBlockSize = 64 * 1024,
+		StreamWindowSize = 64 * 1024,
+
+		// LZ4HC_BLOCKS entries start with a table of block count + 1 uint32
+		// offsets, relative to the entry, followed by independently
+		// compressed blocks of BlockSize bytes. A block whose stored size
+		// equals its decoded size is stored uncompressed.
+		BlockSize = 64 * 1024
 	};
 
 	struct Header
 	{
 		uint32_t size;
 		uint32_t uncompr_size;
-		uint32_t offset;
+		uint64_t offset;
 
 		enum Compression
 		{
 			UNCOMPRESSED,
-			LZ4HC
+			LZ4HC,
+			LZ4HC_STREAM,
+			LZ4HC_BLOCKS,
+
+			// Stored at offset inside the decoded solid block. size equals
+			// uncompr_size and ReadRaw returns the decoded bytes.
+			SOLID,
+
+			// The stored bytes are a list of uint32 chunk indices. The entry
+			// is the concatenation of those chunks, which can be shared with
+			// other entries. Its crc covers the concatenated contents.
+			CHUNKED,
+
+			// LZ4HC compressed using the pack dictionary as history.
+			LZ4HC_DICT,
+
+			// Same block format as LZ4HC, compressed with LZ4 fast by
+			// development builds.
+			LZ4
 		};
 
 		uint8_t compression;
 		uint8_t unused;
 		uint16_t crc;
+
+		// Extra bytes past uncompr_size needed to decompress in place.
+		uint32_t inplace_margin;
+
+		// Null terminated path inside the TOC string pool.
+		uint32_t path_offset;
+		uint32_t path_length;
+
+		uint32_t solid;
+
+		// Fills the tail padding, so every byte of the header is written.
+		uint32_t reserved;
 	};
 
-	std::string path;
+	const char* path;
 	Header header;
+
+	FileEntry() : path(NULL) {}
+};
+
+struct FileView
+{
+	std::shared_ptr<const unsigned char> data;
+	uint32_t size;
+
+	FileView() : size(0) {}
+};
+
+// Several small files compressed together. Stored uncompressed when size
+// equals uncompr_size.
+struct SolidBlock
+{
+	uint64_t offset;
+	uint32_t size;
+	uint32_t uncompr_size;
+};
+
+// Content defined piece of one or more CHUNKED entries. Stored uncompressed
+// when size equals uncompr_size.
+struct Chunk
+{
+	uint64_t offset;
+	uint32_t size;
+	uint32_t uncompr_size;
+};
+
+struct ReadRequest
+{
+	const FileEntry* entry;
+	unsigned char* out;
 };
 
+struct MappedFile;
+
 struct FileSystem
 {
 	FileSystem();
@@ -76,21 +175,137 @@ struct FileSystem
 
 	bool Open(const char* path);
 	bool Open(void* handle, FileCallbacks* callbacks);
+	bool OpenMapped(const char* path);
 	void Close();
 
+	enum
+	{
+		DefaultBatchGap = 64 * 1024,
+		MaxBatchRun = 16 * 1024 * 1024
+	};
+
 	void Read(const FileEntry& entry, unsigned char* out) const;
 	void ReadRaw(const FileEntry& entry, unsigned char* out) const;
 
-	typedef std::map<std::string, FileEntry> EntryMap;
-	const EntryMap& Entries() const;
+	// Same as Read but compressed data is staged in the caller's scratch,
+	// which must hold at least ScratchSize() bytes.
+	void Read(const FileEntry& entry, unsigned char* out, unsigned char* scratch) const;
+	uint32_t ScratchSize() const;
+
+	// Compressed data is loaded at the tail of out and decompressed forward
+	// over itself. out must hold at least InPlaceSize(entry) bytes.
+	void ReadInPlace(const FileEntry& entry, unsigned char* out) const;
+	uint32_t InPlaceSize(const FileEntry& entry) const;
+
+	// Reads all requests sorting them by offset. Entries closer than max_gap
+	// bytes are fetched with a single read of up to MaxBatchRun bytes.
+	void ReadBatch(ReadRequest* requests, std::size_t count, uint32_t max_gap = DefaultBatchGap) const;
+
+	// Only for uncompressed entries of a mapped file. The view keeps the
+	// mapping alive, so it stays valid after Close().
+	bool View(const FileEntry& entry, FileView& view) const;
+	bool IsMapped() const;
+
+	// Reads length bytes of the entry contents starting at offset, decoding
+	// only what the compression mode requires to reach them. Returns the
+	// number of bytes written, which is smaller at the end of the entry.
+	uint32_t ReadRange(const FileEntry& entry, uint32_t offset, uint32_t length, unsigned char* out) const;
+
+	// Cheap probe of the first bytes of an entry, e.g. for file headers.
+	// LZ4HC and LZ4 entries are decoded only until size bytes are available.
+	uint32_t ReadPrefix(const FileEntry& entry, uint32_t size, unsigned char* out) const;
+
+	// LZ4HC_BLOCKS entries can be decoded in independent block ranges, for
+	// example from several threads. Any other entry is a single block.
+	uint32_t BlockCount(const FileEntry& entry) const;
+	void ReadBlocks(const FileEntry& entry, uint32_t first, uint32_t count, unsigned char* out) const;
+
+	// Turns the bytes ReadRaw returns into the entry contents.
+	void Decode(const FileEntry& entry, const unsigned char* src, unsigned char* out) const;
+
+	typedef std::vector<FileEntry> EntryList;
+	const EntryList& Entries() const;
+
+	const FileEntry* Find(const char* path) const;
+	const FileEntry* Find(const char* path, std::size_t length) const;
+	const FileEntry* Find(const std::string& path) const;
 
 private:
+	friend struct FileStream;
+
+	const unsigned char* MappedData(const FileEntry& entry, uint32_t size) const;
+	const unsigned char* MappedRange(uint64_t offset, uint32_t size) const;
+	void ReadSolid(const FileEntry& entry, uint32_t offset, uint32_t length, unsigned char* out) const;
+	void DecodeChunks(const FileEntry& entry, const unsigned char* src, unsigned char* out) const;
+	int ReadAt(unsigned char* out, uint32_t size, uint64_t offset) const;
+	uint32_t DecodePrefix(const FileEntry& entry, uint32_t size, unsigned char* out) const;
+	unsigned char* AcquireScratch() const;
+	void ReleaseScratch(unsigned char* scratch) const;
+	bool Load();
+	void BuildIndex();
+
+	struct IndexSlot
+	{
+		uint64_t hash;
+		uint32_t entry;
+	};
+
 	void* handle;
 	FileCallbacks* cb;
-	EntryMap entries;
+	std::vector<unsigned char> toc;
+	EntryList entries;
+	std::vector<SolidBlock> solids;
+	std::vector<Chunk> chunks;
+	const unsigned char* dictionary;
+	uint32_t dictionary_size;
+	std::vector<IndexSlot> index;
 	uint32_t data_offset;
+	uint32_t max_compressed_size;
+	std::shared_ptr<MappedFile> mapping;
+	mutable std::mutex io_mutex;
+	mutable std::mutex scratch_mutex;
+	mutable std::vector<unsigned char*> scratch_pool;
+	mutable std::mutex solid_mutex;
+	mutable std::shared_ptr<std::vector<unsigned char> > solid_cache;
+	mutable uint32_t solid_cache_index;
+};
+
+// Sequential reader over one entry. LZ4HC_STREAM and LZ4HC_BLOCKS entries are
+// decoded a block at a time, so only a window of a few blocks is kept in
+// memory. Seeking backwards on stream entries restarts from the first block.
+struct FileStream
+{
+	FileStream();
+
+	bool Open(const FileSystem& fs, const FileEntry& entry);
+	void Close();
+
+	uint32_t Read(unsigned char* out, uint32_t size);
+	bool Seek(uint32_t position);
+	uint32_t Tell() const;
+	uint32_t Size() const;
+
+private:
+	void Rewind();
+	bool DecodeNext();
+
+	const FileSystem* fs;
+	const FileEntry* entry;
+	uint32_t position;
+
+	std::vector<unsigned char> window;
+	std::vector<unsigned char> input;
+	uint32_t window_used;
+	uint32_t block_begin;
+	uint32_t block_position;
+	uint32_t block_size;
+	uint32_t next_raw;
+	uint32_t next_raw_size;
 };
 
+uint64_t HashPath(const char* path, std::size_t length);
+int DecodeStreamBlock(const unsigned char*& src, const unsigned char* src_end, unsigned char* out, uint32_t decoded, uint32_t remaining);
+bool DecodeBlocks(const FileEntry& entry, const unsigned char* table, const unsigned char* data, uint32_t first, uint32_t count, unsigned char* out);
 void PrintFileEntry(FileEntry& entry);
 void TestFile(const char* file);
 
@@ -0,0 +1,141 @@
+#include "dictionarytrainer.h"
+
+#include <string.h>
+#include <algorithm>
+#include <unordered_map>
+
+namespace gpack
+{
+
+enum
+{
+	DmerSize = 8,
+	SegmentSize = 512
+};
+
+struct Segment
+{
+	uint32_t begin;
+	uint64_t score;
+};
+
+static uint64_t DmerKey(const unsigned char* data)
+{
+	uint64_t key;
+	memcpy(&key, data, sizeof(key));
+	return key;
+}
+
+std::vector<unsigned char> TrainDictionary(const std::vector<DictionarySample>& samples, uint32_t capacity)
+{
+	std::vector<unsigned char> data;
+	for (size_t i = 0; i < samples.size(); i++)
+		data.insert(data.end(), samples[i].data, samples[i].data + samples[i].size);
+
+	if (data.size() <= capacity)
+		return data;
+
+	// Give every dmer an id and count how many samples it appears in. Dmers
+	// crossing a sample boundary keep no id.
+	std::unordered_map<uint64_t, uint32_t> ids;
+	std::vector<uint32_t> counts;
+	std::vector<uint32_t> last_sample;
+	std::vector<uint32_t> positions(data.size(), UINT32_MAX);
+
+	uint32_t begin = 0;
+	for (uint32_t s = 0; s < (uint32_t) samples.size(); s++)
+	{
+		uint32_t end = begin + samples[s].size;
+		for (uint32_t i = begin; i + DmerSize <= end; i++)
+		{
+			auto it = ids.insert(std::make_pair(DmerKey(&data[i]), (uint32_t) counts.size())).first;
+			uint32_t id = it->second;
+			if (id == counts.size())
+			{
+				counts.push_back(0);
+				last_sample.push_back(UINT32_MAX);
+			}
+
+			if (last_sample[id] != s)
+			{
+				last_sample[id] = s;
+				counts[id]++;
+			}
+
+			positions[i] = id;
+		}
+
+		begin = end;
+	}
+
+	// A dmer only found in one sample does not help compressing the others.
+	for (size_t i = 0; i < counts.size(); i++)
+		counts[i]--;
+
+	// Pick the best segment of every epoch, then stop counting its dmers so
+	// repeated content is only taken once.
+	uint32_t size = (uint32_t) data.size();
+	uint32_t epochs = std::max(capacity / SegmentSize, 1u);
+	uint32_t epoch_size = size / epochs;
+	std::vector<Segment> segments;
+	for (uint32_t e = 0; e < epochs; e++)
+	{
+		uint32_t epoch_begin = e * epoch_size;
+		uint32_t epoch_end = std::min(epoch_begin + epoch_size, size);
+		if (epoch_end - epoch_begin < SegmentSize)
+			continue;
+
+		uint64_t score = 0;
+		for (uint32_t i = epoch_begin; i < epoch_begin + SegmentSize - DmerSize; i++)
+		{
+			if (positions[i] != UINT32_MAX)
+				score += counts[positions[i]];
+		}
+
+		Segment best = { epoch_begin, score };
+		for (uint32_t i = epoch_begin + 1; i + SegmentSize <= epoch_end; i++)
+		{
+			uint32_t removed = positions[i - 1];
+			uint32_t added = positions[i + SegmentSize - DmerSize - 1];
+			if (removed != UINT32_MAX)
+				score -= counts[removed];
+			if (added != UINT32_MAX)
+				score += counts[added];
+
+			if (score > best.score)
+			{
+				best.begin = i;
+				best.score = score;
+			}
+		}
+
+		if (best.score == 0)
+			continue;
+
+		for (uint32_t i = best.begin; i < best.begin + SegmentSize - DmerSize; i++)
+		{
+			if (positions[i] != UINT32_MAX)
+				counts[positions[i]] = 0;
+		}
+
+		segments.push_back(best);
+	}
+
+	std::sort(segments.begin(), segments.end(), [](const Segment& a, const Segment& b) {
+		return a.score > b.score;
+	});
+
+	if (segments.size() * SegmentSize > capacity)
+		segments.resize(capacity / SegmentSize);
+
+	std::vector<unsigned char> dictionary;
+	for (size_t i = segments.size(); i > 0; i--)
+	{
+		const Segment& segment = segments[i - 1];
+		dictionary.insert(dictionary.end(), data.begin() + segment.begin, data.begin() + segment.begin + SegmentSize);
+	}
+
+	return dictionary;
+}
+
+} // namespace gpack
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "gamepacker.h"
+
+namespace gpack
+{
+	struct DictionarySample
+	{
+		const unsigned char* data;
+		uint32_t size;
+	};
+
+	// Builds a dictionary of at most capacity bytes out of the sample
+	// segments whose 8 byte substrings are shared by the most samples.
+	// Segments with the highest score are placed last, closest to the data
+	// being compressed.
+	std::vector<unsigned char> TrainDictionary(const std::vector<DictionarySample>& samples, uint32_t capacity);
+}
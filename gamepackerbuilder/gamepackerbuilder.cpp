@@ -2,9 +2,21 @@
 #include <vector>
 #include <string>
 #include <set>
+#include <map>
+#include <unordered_map>
+#include <deque>
+#include <memory>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include "TinyDir.h"
 #include "crcfast.h"
+#include "dictionarytrainer.h"
+#include "taskpool.h"
 
 #include "lz4.h"
 #include "lz4hc.h"
@@ -12,155 +24,1462 @@
 namespace gpack
 {
 
+// File positions past 2gb, as long is 32 bits on Windows.
+int Seek64(FILE* file, int64_t offset, int whence)
+{
+#ifdef _MSC_VER
+	return _fseeki64(file, offset, whence);
+#else
+	return fseeko(file, (off_t) offset, whence);
+#endif
+}
+
+int64_t Tell64(FILE* file)
+{
+#ifdef _MSC_VER
+	return _ftelli64(file);
+#else
+	return (int64_t) ftello(file);
+#endif
+}
+
 struct FileEntryBuilder
 {
-	FileEntry entry;
-	unsigned char* compressed_data;
+	FileEntry entry;
+	std::string path;
+	unsigned char* compressed_data;
+
+	// Index of an earlier entry with identical contents. The entry then
+	// shares its data and nothing is written for it.
+	size_t duplicate_of;
+
+	// Entries are written as soon as they are compressed, except these,
+	// which keep their original bytes in compressed_data, or at spill_offset
+	// of the spill file, until the dictionary is trained.
+	bool dictionary_pending;
+	uint64_t spill_offset;
+
+	FileEntryBuilder() : compressed_data(NULL), duplicate_of(SIZE_MAX), dictionary_pending(false), spill_offset(0)
+	{
+		memset(&entry.header, 0, sizeof(entry.header));
+	}
+};
+
+struct ContentEntry
+{
+	size_t entry;
+	uint32_t size;
+	uint64_t check;
+};
+
+struct SolidGroup
+{
+	std::vector<unsigned char> data;
+	std::vector<size_t> entries;
+};
+
+// LZ4HC state and scratch memory of one thread, reused for every file it
+// compresses instead of setting them up again each time.
+struct CompressContext
+{
+	LZ4_streamHC_t* state;
+	LZ4_stream_t* fast_state;
+	std::vector<unsigned char> scratch;
+	std::vector<unsigned char> decoded;
+
+	CompressContext() : state(LZ4_createStreamHC()), fast_state(LZ4_createStream()) {}
+	~CompressContext() { LZ4_freeStreamHC(state); LZ4_freeStream(fast_state); }
+
+private:
+	CompressContext(const CompressContext&);
+	CompressContext& operator=(const CompressContext&);
+};
+
+// Grows buffer to at least size bytes. It never shrinks, so a reused buffer
+// stops allocating once it has seen the largest file.
+unsigned char* Reserve(std::vector<unsigned char>& buffer, size_t size)
+{
+	if (buffer.size() < size)
+		buffer.resize(size);
+
+	return buffer.data();
+}
+
+// Compresses one LZ4 block with LZ4 fast at the given acceleration, or with
+// LZ4HC when it is 0.
+int CompressBlock(CompressContext& context, int acceleration, const unsigned char* src, int size, unsigned char* dst, int dst_size)
+{
+	if (acceleration > 0)
+		return LZ4_compress_fast_extState(context.fast_state, (const char*) src, (char*) dst, size, dst_size, acceleration);
+
+	return LZ4_compress_HC_extStateHC(context.state, (const char*) src, (char*) dst, size, dst_size, 9);
+}
+
+struct FilePackerBuilder
+{
+	enum
+	{
+		MaxSolidBlockSize = 1024 * 1024,
+
+		// Chunk boundaries are placed where the top ChunkBits of the gear
+		// hash are zero, giving chunks of MinChunkSize + 8kb on average.
+		MinChunkSize = 2 * 1024,
+		MaxChunkSize = 64 * 1024,
+		ChunkBits = 13,
+
+		// LZ4 only looks 64kb back, so a larger dictionary would not help.
+		DictionarySize = 64 * 1024,
+
+		// Samples beyond this size are compressed but not used for training.
+		MaxDictionarySamples = 8 * 1024 * 1024,
+
+		DefaultMemoryLimit = 256 * 1024 * 1024,
+
+		// LZ4HC_BLOCKS files larger than this are compressed in segments of
+		// this many bytes on several threads.
+		SegmentSize = 64 * FileEntry::BlockSize,
+
+		// Files of at least one window are sampled in up to EntropySamples
+		// windows before compressing them.
+		EntropyWindowSize = 4 * 1024,
+		EntropySamples = 16
+	};
+
+	std::vector<FileEntryBuilder> entries;
+	uint64_t current_offset;
+	uint32_t stream_threshold;
+	uint32_t block_threshold;
+	uint32_t solid_threshold;
+	BuildParameters::SolidGrouping solid_grouping;
+	std::map<std::string, SolidGroup> solid_groups;
+	uint64_t solid_bytes;
+	std::vector<SolidBlock> solids;
+	std::unordered_multimap<uint64_t, ContentEntry> contents;
+	uint32_t chunk_threshold;
+	std::vector<Chunk> chunks;
+	std::unordered_multimap<uint64_t, uint32_t> chunk_contents;
+	uint32_t dictionary_threshold;
+	std::vector<unsigned char> dictionary;
+	uint64_t pending_bytes;
+	FILE* spill;
+	uint64_t spill_size;
+	FILE* out;
+	std::string out_path;
+
+	// Set on an error that makes the pack unusable, which is then removed
+	// instead of written.
+	bool failed;
+
+	// Files read ahead of the compressor, open solid groups and entries
+	// waiting for the dictionary each get a share of the memory limit.
+	uint64_t read_budget;
+	uint64_t solid_budget;
+	uint64_t pending_budget;
+	unsigned threads;
+
+	// Cost model of the target, see BuildParameters.
+	uint32_t read_speed;
+	uint32_t decode_scale;
+
+	// LZ4 fast acceleration for development builds, 0 compresses with LZ4HC.
+	int acceleration;
+
+	// Used by the calling thread for solid blocks, chunks and dictionary
+	// compression.
+	CompressContext context;
+
+	// Files stored as they are without trying to compress them.
+	uint32_t stored_by_format;
+	uint32_t stored_by_entropy;
+	uint64_t stored_bytes;
+
+	FilePackerBuilder()
+		: current_offset(0)
+		, stream_threshold(0)
+		, block_threshold(0)
+		, solid_threshold(0)
+		, solid_grouping(BuildParameters::SOLID_BY_DIRECTORY)
+		, solid_bytes(0)
+		, chunk_threshold(0)
+		, dictionary_threshold(0)
+		, pending_bytes(0)
+		, spill(NULL)
+		, spill_size(0)
+		, out(NULL)
+		, failed(false)
+		, read_budget(0)
+		, solid_budget(0)
+		, pending_budget(0)
+		, threads(0)
+		, read_speed(0)
+		, decode_scale(100)
+		, acceleration(0)
+		, stored_by_format(0)
+		, stored_by_entropy(0)
+		, stored_bytes(0) {}
+
+	void SetMemoryLimit(uint64_t limit)
+	{
+		read_budget = limit / 2;
+		solid_budget = limit / 4;
+		pending_budget = limit / 4;
+	}
+};
+
+bool OpenBuilder(FilePackerBuilder& builder, const std::string& out_path)
+{
+	std::string out = out_path;
+	if (out.empty())
+		out = "a.out";
+
+	FILEPACKER_LOGV("\n -- Writing packed file system on %s --\n", out.c_str());
+
+	builder.out = fopen(out.c_str(), "wb+");
+	if (builder.out == NULL)
+	{
+		FILEPACKER_LOGE("ERROR: Unable to create %s\n", out.c_str());
+		return false;
+	}
+
+	builder.out_path = out;
+
+	FilePackerHeader header;
+	header.Init();
+	fwrite(&header, sizeof(FilePackerHeader), 1, builder.out);
+	return true;
+}
+
+// Appends data to the pack and returns its offset, relative to the end of
+// the header.
+uint64_t WriteData(FilePackerBuilder& builder, const void* data, uint32_t size)
+{
+	if (builder.failed)
+		return 0;
+
+	uint64_t offset = builder.current_offset;
+	if (size > 0 && fwrite(data, size, 1, builder.out) != 1)
+	{
+		FILEPACKER_LOGE("ERROR: Unable to write packed data.\n");
+		builder.failed = true;
+		return 0;
+	}
+
+	builder.current_offset += size;
+	return offset;
+}
+
+// Reads back data already written. Failing to do so fails the build.
+bool ReadData(FilePackerBuilder& builder, uint64_t offset, uint32_t size, unsigned char* out)
+{
+	bool result = Seek64(builder.out, (int64_t) sizeof(FilePackerHeader) + offset, SEEK_SET) == 0
+		&& fread(out, 1, size, builder.out) == size;
+
+	Seek64(builder.out, 0, SEEK_END);
+	if (!result)
+	{
+		FILEPACKER_LOGE("ERROR: Unable to read back packed data.\n");
+		builder.failed = true;
+	}
+
+	return result;
+}
+
+// Writes the TOC and the trailer after the data and closes the pack.
+void WriteBuilder(FilePackerBuilder& builder)
+{
+	if (builder.failed)
+	{
+		for (size_t i = 0; i < builder.entries.size(); i++)
+			delete[] builder.entries[i].compressed_data;
+
+		if (builder.spill != NULL)
+			fclose(builder.spill);
+
+		builder.spill = NULL;
+		fclose(builder.out);
+		builder.out = NULL;
+		remove(builder.out_path.c_str());
+		FILEPACKER_LOGE("ERROR: Build failed, %s was not written.\n", builder.out_path.c_str());
+		return;
+	}
+
+	FilePackerTrailer trailer;
+	trailer.toc_offset = sizeof(FilePackerHeader) + builder.current_offset;
+	trailer.file_count = (uint32_t) builder.entries.size();
+
+	std::string pool;
+	for (size_t i = 0; i < trailer.file_count; i++)
+	{
+		FileEntryBuilder& entrybuilder = builder.entries[i];
+		if (entrybuilder.duplicate_of != SIZE_MAX)
+			entrybuilder.entry.header = builder.entries[entrybuilder.duplicate_of].entry.header;
+
+		size_t str_offset = 0;
+		uint32_t length = (uint32_t) entrybuilder.path.length();
+		if (length > FileEntry::MaxPathLength)
+		{
+			FILEPACKER_LOGE("WARNING: File %s is too long. Truncating.", entrybuilder.path.c_str());
+			str_offset = length - FileEntry::MaxPathLength;
+			length = FileEntry::MaxPathLength;
+		}
+
+		entrybuilder.entry.header.path_offset = (uint32_t) pool.length();
+		entrybuilder.entry.header.path_length = length;
+		pool.append(entrybuilder.path, str_offset, length);
+		pool.push_back('\0');
+	}
+
+	trailer.solid_count = (uint32_t) builder.solids.size();
+	trailer.chunk_count = (uint32_t) builder.chunks.size();
+	trailer.dictionary_size = (uint32_t) builder.dictionary.size();
+	trailer.toc_size = (uint32_t) (trailer.file_count * sizeof(FileEntry::Header) + trailer.solid_count * sizeof(SolidBlock) + trailer.chunk_count * sizeof(Chunk) + trailer.dictionary_size + pool.length());
+	trailer.unused = 0;
+
+	for (size_t i = 0; i < trailer.file_count; i++)
+	{
+		FileEntry& entry = builder.entries[i].entry;
+		fwrite(&entry.header, sizeof(entry.header), 1, builder.out);
+	}
+
+	// The tables may be empty, and so have no data to point to.
+	if (!builder.solids.empty())
+		fwrite(builder.solids.data(), sizeof(SolidBlock), builder.solids.size(), builder.out);
+
+	if (!builder.chunks.empty())
+		fwrite(builder.chunks.data(), sizeof(Chunk), builder.chunks.size(), builder.out);
+
+	if (!builder.dictionary.empty())
+		fwrite(builder.dictionary.data(), 1, builder.dictionary.size(), builder.out);
+
+	fwrite(pool.data(), sizeof(char), pool.length(), builder.out);
+	fwrite(&trailer, sizeof(FilePackerTrailer), 1, builder.out);
+
+	fclose(builder.out);
+	builder.out = NULL;
+}
+
+// Smallest margin for which decompressing the data from the tail of the
+// destination buffer does not overwrite input that is still to be read.
+uint32_t InPlaceMargin(CompressContext& context, const unsigned char* original, const unsigned char* compressed, uint32_t size, uint32_t uncompr_size)
+{
+	uint32_t margin = (size >> 8) + 32;
+	if (margin > size)
+		margin = size;
+
+	unsigned char* buffer = Reserve(context.scratch, uncompr_size + size);
+	while (margin < size)
+	{
+		unsigned char* src = buffer + uncompr_size + margin - size;
+		memcpy(src, compressed, size);
+		int result = LZ4_decompress_safe((const char*) src, (char*) buffer, size, uncompr_size);
+		if (result == (int) uncompr_size && memcmp(buffer, original, uncompr_size) == 0)
+			break;
+
+		margin = margin * 2 < size ? margin * 2 : size;
+	}
+
+	return margin;
+}
+
+int StreamCompressBound(uint32_t size)
+{
+	uint32_t blocks = (size + FileEntry::StreamBlockSize - 1) / FileEntry::StreamBlockSize;
+	return blocks * (sizeof(uint32_t) + LZ4_COMPRESSBOUND(FileEntry::StreamBlockSize));
+}
+
+// Compresses src as a sequence of size prefixed blocks, each one using the
+// previous ones as dictionary. Returns 0 on failure.
+int LZ4_compress_stream(CompressContext& context, int acceleration, const unsigned char* src, uint32_t size, unsigned char* dst, int dst_size)
+{
+	if (acceleration > 0)
+		LZ4_resetStream(context.fast_state);
+	else
+		LZ4_resetStreamHC(context.state, 9);
+
+	int written = 0;
+	for (uint32_t pos = 0; pos < size; pos += FileEntry::StreamBlockSize)
+	{
+		int block = (int) std::min(size - pos, (uint32_t) FileEntry::StreamBlockSize);
+		int avail = dst_size - written - (int) sizeof(uint32_t);
+		char* out = (char*) dst + written + sizeof(uint32_t);
+		int result = 0;
+		if (acceleration > 0)
+			result = LZ4_compress_fast_continue(context.fast_state, (const char*) src + pos, out, block, avail, acceleration);
+		else
+			result = LZ4_compress_HC_continue(context.state, (const char*) src + pos, out, block, avail);
+
+		if (result <= 0)
+		{
+			written = 0;
+			break;
+		}
+
+		uint32_t block_size = result;
+		memcpy(dst + written, &block_size, sizeof(block_size));
+		written += sizeof(block_size) + result;
+	}
+
+	return written;
+}
+
+int BlocksCompressBound(uint32_t size)
+{
+	uint32_t blocks = (size + FileEntry::BlockSize - 1) / FileEntry::BlockSize;
+	return (blocks + 1) * sizeof(uint32_t) + blocks * LZ4_COMPRESSBOUND(FileEntry::BlockSize);
+}
+
+// Compresses src as a block offset table followed by independently
+// compressed blocks. Blocks that don't shrink are stored as they are.
+int LZ4_compress_blocks(CompressContext& context, int acceleration, const unsigned char* src, uint32_t size, unsigned char* dst, int dst_size)
+{
+	uint32_t blocks = (size + FileEntry::BlockSize - 1) / FileEntry::BlockSize;
+	uint32_t written = (blocks + 1) * sizeof(uint32_t);
+	for (uint32_t i = 0; i < blocks; i++)
+	{
+		memcpy(dst + i * sizeof(uint32_t), &written, sizeof(written));
+
+		uint32_t pos = i * FileEntry::BlockSize;
+		int block = (int) std::min(size - pos, (uint32_t) FileEntry::BlockSize);
+		int result = CompressBlock(context, acceleration, src + pos, block, dst + written, dst_size - written);
+		if (result <= 0 || result >= block)
+		{
+			memcpy(dst + written, src + pos, block);
+			result = block;
+		}
+
+		written += result;
+	}
+
+	memcpy(dst + blocks * sizeof(uint32_t), &written, sizeof(written));
+	return (int) written;
+}
+
+void FlushSolidGroup(FilePackerBuilder& builder, SolidGroup& group)
+{
+	if (group.entries.empty())
+		return;
+
+	SolidBlock block;
+	block.uncompr_size = (uint32_t) group.data.size();
+
+	int lz4_size_bound = LZ4_compressBound(block.uncompr_size);
+	unsigned char* lz4_out_bound = Reserve(builder.context.scratch, lz4_size_bound);
+	int lz4_size = 0;
+	if (block.uncompr_size > 0)
+		lz4_size = CompressBlock(builder.context, builder.acceleration, group.data.data(), block.uncompr_size, lz4_out_bound, lz4_size_bound);
+
+	if (lz4_size > 0 && (uint32_t) lz4_size < block.uncompr_size)
+	{
+		block.size = lz4_size;
+		block.offset = WriteData(builder, lz4_out_bound, block.size);
+	}
+	else
+	{
+		block.size = block.uncompr_size;
+		block.offset = WriteData(builder, group.data.data(), block.size);
+	}
+
+	uint32_t index = (uint32_t) builder.solids.size();
+	for (size_t i = 0; i < group.entries.size(); i++)
+		builder.entries[group.entries[i]].entry.header.solid = index;
+
+	FILEPACKER_LOGV(" - Solid block %u: %u files, %u -> %u bytes\n", index, (uint32_t) group.entries.size(), block.uncompr_size, block.size);
+
+	builder.solids.push_back(block);
+	builder.solid_bytes -= group.data.size();
+	group.data.clear();
+	group.entries.clear();
+}
+
+void FlushSolidGroups(FilePackerBuilder& builder)
+{
+	auto it = builder.solid_groups.begin();
+	for (; it != builder.solid_groups.end(); it++)
+		FlushSolidGroup(builder, it->second);
+
+	builder.solid_groups.clear();
+}
+
+// Appends the file to the open solid block of its group. The entry has to be
+// the next one pushed to builder.entries.
+void AddSolidFile(FilePackerBuilder& builder, FileEntry& entry, const unsigned char* buffer, const std::string& path, const char* name)
+{
+	std::string key = path;
+	if (builder.solid_grouping == BuildParameters::SOLID_BY_EXTENSION)
+	{
+		const char* ext = strrchr(name, '.');
+		key = ext != NULL ? ext + 1 : "";
+	}
+
+	// Too many bytes in open groups, close the largest ones.
+	while (builder.solid_bytes > 0 && builder.solid_bytes + entry.header.uncompr_size > builder.solid_budget)
+	{
+		auto largest = builder.solid_groups.begin();
+		for (auto it = builder.solid_groups.begin(); it != builder.solid_groups.end(); it++)
+		{
+			if (it->second.data.size() > largest->second.data.size())
+				largest = it;
+		}
+
+		FlushSolidGroup(builder, largest->second);
+	}
+
+	SolidGroup& group = builder.solid_groups[key];
+	if (group.data.size() + entry.header.uncompr_size > FilePackerBuilder::MaxSolidBlockSize)
+		FlushSolidGroup(builder, group);
+
+	entry.header.compression = FileEntry::Header::SOLID;
+	entry.header.size = entry.header.uncompr_size;
+	entry.header.offset = (uint32_t) group.data.size();
+	entry.header.inplace_margin = 0;
+
+	group.data.insert(group.data.end(), buffer, buffer + entry.header.uncompr_size);
+	group.entries.push_back(builder.entries.size());
+	builder.solid_bytes += entry.header.uncompr_size;
+}
+
+uint64_t HashContent(const unsigned char* data, uint32_t size)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (uint32_t i = 0; i < size; i++)
+	{
+		hash ^= data[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+// Second hash of the contents, independent of HashContent, 8 bytes at a
+// time with a murmur style finalizer.
+uint64_t CheckContent(const unsigned char* data, uint32_t size)
+{
+	uint64_t hash = size * 0x9E3779B97F4A7C15ULL;
+	uint32_t i = 0;
+	for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+	{
+		uint64_t value;
+		memcpy(&value, data + i, sizeof(value));
+		hash ^= value * 0xC2B2AE3D27D4EB4FULL;
+		hash = ((hash << 31) | (hash >> 33)) * 0x9E3779B97F4A7C15ULL;
+	}
+
+	for (; i < size; i++)
+		hash = (hash ^ data[i]) * 0x100000001B3ULL;
+
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+// Returns the index of an already added entry that likely has the same
+// contents, or SIZE_MAX. A match needs the size and both 64 bit hashes to be
+// equal, and BuildAddFile still compares the bytes before sharing the entry.
+size_t FindDuplicate(FilePackerBuilder& builder, uint64_t hash, uint64_t check, uint32_t size)
+{
+	auto range = builder.contents.equal_range(hash);
+	for (auto it = range.first; it != range.second; it++)
+	{
+		if (it->second.size == size && it->second.check == check)
+			return it->second.entry;
+	}
+
+	return SIZE_MAX;
+}
+
+struct GearTable
+{
+	uint64_t values[256];
+
+	GearTable()
+	{
+		uint64_t state = 0x9E3779B97F4A7C15ULL;
+		for (int i = 0; i < 256; i++)
+		{
+			// splitmix64
+			uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			values[i] = z ^ (z >> 31);
+		}
+	}
+};
+
+static const GearTable gear_table;
+
+// Length of the next content defined chunk at data. Boundaries only depend on
+// the last 64 bytes, so an edit inside a file only changes the chunks around
+// it.
+uint32_t NextChunkSize(const unsigned char* data, uint32_t size)
+{
+	if (size <= FilePackerBuilder::MinChunkSize)
+		return size;
+
+	uint32_t limit = std::min(size, (uint32_t) FilePackerBuilder::MaxChunkSize);
+	uint64_t hash = 0;
+	for (uint32_t i = 0; i < limit; i++)
+	{
+		hash = (hash << 1) + gear_table.values[data[i]];
+		if (i >= FilePackerBuilder::MinChunkSize && (hash >> (64 - FilePackerBuilder::ChunkBits)) == 0)
+			return i + 1;
+	}
+
+	return limit;
+}
+
+// Reads back size bytes written at offset, decoding them when they are a
+// single LZ4 block of uncompr_size bytes.
+bool ReadDecoded(FilePackerBuilder& builder, uint64_t offset, uint32_t size, uint32_t uncompr_size, unsigned char* out)
+{
+	if (size == uncompr_size)
+		return ReadData(builder, offset, size, out);
+
+	std::vector<unsigned char> stored(size);
+	if (!ReadData(builder, offset, size, stored.data()))
+		return false;
+
+	return LZ4_decompress_safe((const char*) stored.data(), (char*) out, size, uncompr_size) == (int) uncompr_size;
+}
+
+// Compares data with a chunk already written to the pack.
+bool SameChunk(FilePackerBuilder& builder, const Chunk& chunk, const unsigned char* data, uint32_t size)
+{
+	if (chunk.uncompr_size != size)
+		return false;
+
+	std::vector<unsigned char> decoded(size);
+	return ReadDecoded(builder, chunk.offset, chunk.size, size, decoded.data()) && memcmp(decoded.data(), data, size) == 0;
+}
+
+// Returns the index of the chunk holding data, storing it if it is new.
+uint32_t AddChunk(FilePackerBuilder& builder, const unsigned char* data, uint32_t size)
+{
+	uint64_t hash = HashContent(data, size);
+	auto range = builder.chunk_contents.equal_range(hash);
+	for (auto it = range.first; it != range.second; it++)
+	{
+		if (SameChunk(builder, builder.chunks[it->second], data, size))
+			return it->second;
+	}
+
+	Chunk chunk;
+	chunk.uncompr_size = size;
+
+	int lz4_size_bound = LZ4_compressBound(size);
+	unsigned char* lz4_out_bound = Reserve(builder.context.scratch, lz4_size_bound);
+	int lz4_size = CompressBlock(builder.context, builder.acceleration, data, size, lz4_out_bound, lz4_size_bound);
+	if (lz4_size > 0 && (uint32_t) lz4_size < size)
+	{
+		chunk.size = lz4_size;
+		chunk.offset = WriteData(builder, lz4_out_bound, chunk.size);
+	}
+	else
+	{
+		chunk.size = size;
+		chunk.offset = WriteData(builder, data, chunk.size);
+	}
+
+	uint32_t index = (uint32_t) builder.chunks.size();
+	builder.chunks.push_back(chunk);
+	builder.chunk_contents.insert(std::make_pair(hash, index));
+	return index;
+}
+
+// Decodes the contents of an entry already added, from the pack or from the
+// open solid group or pending dictionary entry still holding them.
+bool LoadEntry(FilePackerBuilder& builder, size_t index, unsigned char* out)
+{
+	const FileEntryBuilder& entrybuilder = builder.entries[index];
+	const FileEntry::Header& header = entrybuilder.entry.header;
+	if (entrybuilder.dictionary_pending)
+	{
+		if (entrybuilder.compressed_data != NULL)
+		{
+			memcpy(out, entrybuilder.compressed_data, header.uncompr_size);
+			return true;
+		}
+
+		if (builder.spill == NULL)
+			return header.uncompr_size == 0;
+
+		bool result = Seek64(builder.spill, (int64_t) entrybuilder.spill_offset, SEEK_SET) == 0
+			&& fread(out, 1, header.uncompr_size, builder.spill) == header.uncompr_size;
+
+		Seek64(builder.spill, 0, SEEK_END);
+		return result;
+	}
+
+	if (header.compression == FileEntry::Header::SOLID)
+	{
+		auto it = builder.solid_groups.begin();
+		for (; it != builder.solid_groups.end(); it++)
+		{
+			const SolidGroup& group = it->second;
+			if (std::find(group.entries.begin(), group.entries.end(), index) != group.entries.end())
+			{
+				memcpy(out, group.data.data() + header.offset, header.uncompr_size);
+				return true;
+			}
+		}
+
+		if (header.solid >= builder.solids.size())
+			return false;
+
+		const SolidBlock& block = builder.solids[header.solid];
+		std::vector<unsigned char> decoded(block.uncompr_size);
+		if (!ReadDecoded(builder, block.offset, block.size, block.uncompr_size, decoded.data()))
+			return false;
+
+		memcpy(out, decoded.data() + header.offset, header.uncompr_size);
+		return true;
+	}
+
+	if (header.compression == FileEntry::Header::UNCOMPRESSED
+		|| header.compression == FileEntry::Header::LZ4HC
+		|| header.compression == FileEntry::Header::LZ4)
+	{
+		return ReadDecoded(builder, header.offset, header.size, header.uncompr_size, out);
+	}
+
+	std::vector<unsigned char> stored(header.size);
+	if (!ReadData(builder, header.offset, header.size, stored.data()))
+		return false;
+
+	if (header.compression == FileEntry::Header::CHUNKED)
+	{
+		uint32_t decoded = 0;
+		for (uint32_t i = 0; i < header.size / sizeof(uint32_t); i++)
+		{
+			uint32_t chunk_index;
+			memcpy(&chunk_index, stored.data() + i * sizeof(uint32_t), sizeof(chunk_index));
+			if (chunk_index >= builder.chunks.size())
+				return false;
+
+			const Chunk& chunk = builder.chunks[chunk_index];
+			if (chunk.uncompr_size > header.uncompr_size - decoded
+				|| !ReadDecoded(builder, chunk.offset, chunk.size, chunk.uncompr_size, out + decoded))
+			{
+				return false;
+			}
+
+			decoded += chunk.uncompr_size;
+		}
+
+		return decoded == header.uncompr_size;
+	}
+	else if (header.compression == FileEntry::Header::LZ4HC_STREAM)
+	{
+		const unsigned char* src = stored.data();
+		uint32_t decoded = 0;
+		while (decoded < header.uncompr_size)
+		{
+			int result = DecodeStreamBlock(src, stored.data() + stored.size(), out, decoded, header.uncompr_size - decoded);
+			if (result <= 0)
+				return false;
+
+			decoded += result;
+		}
+
+		return true;
+	}
+	else if (header.compression == FileEntry::Header::LZ4HC_BLOCKS)
+	{
+		uint32_t count = (uint32_t) (((uint64_t) header.uncompr_size + FileEntry::BlockSize - 1) / FileEntry::BlockSize);
+		uint32_t begin = 0;
+		if ((count + 1) * (uint64_t) sizeof(uint32_t) <= header.size)
+			memcpy(&begin, stored.data(), sizeof(begin));
+
+		return begin > 0 && begin <= header.size && DecodeBlocks(entrybuilder.entry, stored.data(), stored.data() + begin, 0, count, out);
+	}
+
+	return false;
+}
+
+// Compares data with the contents of an entry already added.
+bool SameEntry(FilePackerBuilder& builder, size_t index, const unsigned char* data, uint32_t size)
+{
+	if (builder.entries[index].entry.header.uncompr_size != size)
+		return false;
+
+	std::vector<unsigned char> contents(size);
+	return LoadEntry(builder, index, contents.data()) && memcmp(contents.data(), data, size) == 0;
+}
+
+// Keeps the original bytes of an entry until the dictionary is trained,
+// moving them to the spill file once the pending budget is used.
+void HoldForDictionary(FilePackerBuilder& builder, FileEntryBuilder& entrybuilder, unsigned char* buffer)
+{
+	uint32_t size = entrybuilder.entry.header.uncompr_size;
+	entrybuilder.dictionary_pending = true;
+	if (builder.pending_bytes + size > builder.pending_budget)
+	{
+		if (builder.spill == NULL)
+			builder.spill = tmpfile();
+
+		if (builder.spill != NULL)
+		{
+			entrybuilder.spill_offset = builder.spill_size;
+			if (fwrite(buffer, 1, size, builder.spill) != size)
+			{
+				FILEPACKER_LOGE("ERROR: Unable to write to the spill file.\n");
+				builder.failed = true;
+			}
+
+			builder.spill_size += size;
+			delete[] buffer;
+			return;
+		}
+
+		FILEPACKER_LOGE("WARNING: Unable to create spill file, keeping files in memory.\n");
+	}
+
+	entrybuilder.compressed_data = buffer;
+	builder.pending_bytes += size;
+}
+
+enum Compressibility
+{
+	COMPRESSIBLE,
+	KNOWN_FORMAT,
+	HIGH_ENTROPY
+};
+
+// The first size bytes of data hold the file compressed, unless compression
+// is UNCOMPRESSED. data is kept between files to reuse its memory.
+struct CompressedFile
+{
+	uint8_t compression;
+	uint32_t size;
+	uint32_t inplace_margin;
+	Compressibility compressibility;
+	std::vector<unsigned char> data;
+
+	CompressedFile() : compression(FileEntry::Header::UNCOMPRESSED), size(0), inplace_margin(0), compressibility(COMPRESSIBLE) {}
+};
+
+// Files that are compressed on their own, rather than in a solid block, with
+// the dictionary or as chunks. Those depend on earlier files and are done in
+// order by BuildAddFile.
+bool CompressesAlone(const FilePackerBuilder& builder, bool compress, uint32_t size)
+{
+	return compress
+		&& !(builder.solid_threshold > 0 && size < builder.solid_threshold)
+		&& !(builder.dictionary_threshold > 0 && size < builder.dictionary_threshold)
+		&& !(builder.chunk_threshold > 0 && size >= builder.chunk_threshold);
+}
+
+// Files over SegmentSize are compressed as blocks even without a block
+// threshold, so they are split across threads, and so files past what a
+// single LZ4 call can take are compressed at all.
+FileEntry::Header::Compression SelectMode(const FilePackerBuilder& builder, uint32_t uncompr_size)
+{
+	if (builder.block_threshold > 0 && uncompr_size >= builder.block_threshold)
+		return FileEntry::Header::LZ4HC_BLOCKS;
+	else if (builder.stream_threshold > 0 && uncompr_size >= builder.stream_threshold && uncompr_size <= LZ4_MAX_INPUT_SIZE)
+		return FileEntry::Header::LZ4HC_STREAM;
+	else if (uncompr_size > FilePackerBuilder::SegmentSize)
+		return FileEntry::Header::LZ4HC_BLOCKS;
+	else if (builder.acceleration > 0)
+		return FileEntry::Header::LZ4;
+
+	return FileEntry::Header::LZ4HC;
+}
+
+struct FileSignature
+{
+	uint32_t offset;
+	uint32_t length;
+	const char* bytes;
+};
+
+// Formats that are compressed already.
+static const FileSignature compressed_signatures[] =
+{
+	{ 0, 8, "\x89PNG\r\n\x1a\n" },
+	{ 0, 3, "\xff\xd8\xff" },
+	{ 0, 4, "OggS" },
+	{ 4, 4, "ftyp" },
+	{ 8, 4, "WEBP" },
+	{ 0, 4, "fLaC" },
+	{ 0, 4, "PK\x03\x04" },
+	{ 0, 2, "\x1f\x8b" },
+	{ 0, 3, "BZh" },
+	{ 0, 6, "7z\xbc\xaf\x27\x1c" },
+	{ 0, 6, "\xfd" "7zXZ\x00" },
+	{ 0, 4, "\x28\xb5\x2f\xfd" },
+	{ 0, 4, "\x04\x22\x4d\x18" },
+	{ 0, 6, "Rar!\x1a\x07" },
+};
+
+// Shannon entropy of the bytes in data, in bits per byte.
+double ByteEntropy(const unsigned char* data, uint32_t size)
+{
+	uint32_t histogram[256] = { 0 };
+	for (uint32_t i = 0; i < size; i++)
+		histogram[data[i]]++;
+
+	double entropy = 0.0;
+	for (int i = 0; i < 256; i++)
+	{
+		if (histogram[i] == 0)
+			continue;
+
+		double p = histogram[i] / (double) size;
+		entropy -= p * std::log(p);
+	}
+
+	return entropy / std::log(2.0);
+}
+
+// Guesses, without compressing, whether LZ4 could get the file under 75%.
+// Data that looks random in every sampled window is left as it is: an
+// order-0 estimate misses repeats, but LZ4 finds few in such data.
+Compressibility CheckCompressibility(const unsigned char* data, uint32_t size)
+{
+	for (size_t i = 0; i < sizeof(compressed_signatures) / sizeof(compressed_signatures[0]); i++)
+	{
+		const FileSignature& signature = compressed_signatures[i];
+		if (size >= signature.offset + signature.length && memcmp(data + signature.offset, signature.bytes, signature.length) == 0)
+			return KNOWN_FORMAT;
+	}
+
+	if (size < FilePackerBuilder::EntropyWindowSize)
+		return COMPRESSIBLE;
+
+	uint32_t windows = std::min(size / FilePackerBuilder::EntropyWindowSize, (uint32_t) FilePackerBuilder::EntropySamples);
+	uint32_t stride = windows > 1 ? (size - FilePackerBuilder::EntropyWindowSize) / (windows - 1) : 0;
+	for (uint32_t i = 0; i < windows; i++)
+	{
+		if (ByteEntropy(data + i * stride, FilePackerBuilder::EntropyWindowSize) < 7.8)
+			return COMPRESSIBLE;
+	}
+
+	return HIGH_ENTROPY;
+}
+
+// LZ4 levels tried by the cost model, 0 being LZ4 fast and the rest LZ4HC.
+// Fast builds only try the first.
+static const int load_time_levels[] = { 0, 4, 9, 12 };
+
+// Seconds from an arbitrary start, with a monotonic clock. VS2013 backs
+// high_resolution_clock with the system clock, so Windows uses the
+// performance counter.
+double Now()
+{
+#ifdef _MSC_VER
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (double) counter.QuadPart / (double) frequency.QuadPart;
+#else
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Seconds this machine takes to decode src. Small files decode faster than
+// the clock resolution, so they are decoded until a millisecond has passed.
+double DecodeTime(const unsigned char* src, uint32_t size, unsigned char* dst, uint32_t uncompr_size)
+{
+	double start = Now();
+	double elapsed = 0.0;
+	int runs = 0;
+	do
+	{
+		LZ4_decompress_safe((const char*) src, (char*) dst, size, uncompr_size);
+		elapsed = Now() - start;
+		runs++;
+	}
+	while (elapsed < 0.001 && runs < 4096);
+
+	return elapsed / runs;
+}
+
+// Expected seconds to load size bytes from the target and decode them.
+double LoadTime(const FilePackerBuilder& builder, uint32_t size, double decode_time)
+{
+	return size / (builder.read_speed * 1024.0 * 1024.0) + decode_time * builder.decode_scale / 100.0;
+}
+
+// Stores the file, or compresses it with LZ4 or one of the LZ4HC levels,
+// whichever the cost model expects to load fastest.
+void CompressForLoadTime(const FilePackerBuilder& builder, CompressContext& context, const unsigned char* buffer, uint32_t uncompr_size, CompressedFile& result)
+{
+	double best = LoadTime(builder, uncompr_size, 0.0);
+	int lz4_size_bound = LZ4_compressBound(uncompr_size);
+	unsigned char* decoded = Reserve(context.decoded, uncompr_size);
+	size_t levels = builder.acceleration > 0 ? 1 : sizeof(load_time_levels) / sizeof(load_time_levels[0]);
+	int acceleration = builder.acceleration > 0 ? builder.acceleration : 1;
+	for (size_t i = 0; i < levels; i++)
+	{
+		int level = load_time_levels[i];
+		unsigned char* lz4_out_bound = Reserve(context.scratch, lz4_size_bound);
+		int lz4_size = 0;
+		if (level == 0)
+			lz4_size = LZ4_compress_fast_extState(context.fast_state, (const char*) buffer, (char*) lz4_out_bound, uncompr_size, lz4_size_bound, acceleration);
+		else
+			lz4_size = LZ4_compress_HC_extStateHC(context.state, (const char*) buffer, (char*) lz4_out_bound, uncompr_size, lz4_size_bound, level);
+
+		if (lz4_size <= 0)
+			continue;
+
+		double time = LoadTime(builder, lz4_size, DecodeTime(lz4_out_bound, lz4_size, decoded, uncompr_size));
+		if (time < best)
+		{
+			best = time;
+			result.compression = level == 0 ? FileEntry::Header::LZ4 : FileEntry::Header::LZ4HC;
+			result.size = lz4_size;
+			result.data.swap(context.scratch);
+		}
+	}
+
+	if (result.compression != FileEntry::Header::UNCOMPRESSED)
+		result.inplace_margin = InPlaceMargin(context, buffer, result.data.data(), result.size, uncompr_size);
+}
+
+// Only reads the builder settings, so it can run on any thread with its own
+// context. Leaves result UNCOMPRESSED when the file is better stored as is.
+void CompressFile(const FilePackerBuilder& builder, CompressContext& context, const unsigned char* buffer, uint32_t uncompr_size, CompressedFile& result)
+{
+	result.compressibility = CheckCompressibility(buffer, uncompr_size);
+	if (result.compressibility != COMPRESSIBLE)
+		return;
+
+	// Only segments take files past what a single LZ4 call, sized in ints,
+	// can compress.
+	if (uncompr_size > LZ4_MAX_INPUT_SIZE)
+	{
+		FILEPACKER_LOGE("WARNING: A file of %u bytes is too large to compress unsplit, storing it.\n", uncompr_size);
+		return;
+	}
+
+	FileEntry::Header::Compression mode = SelectMode(builder, uncompr_size);
+	if ((mode == FileEntry::Header::LZ4HC || mode == FileEntry::Header::LZ4) && builder.read_speed > 0)
+	{
+		CompressForLoadTime(builder, context, buffer, uncompr_size, result);
+		return;
+	}
+
+	unsigned char* lz4_out_bound = NULL;
+	int lz4_size = 0;
+	int lz4_size_bound = 0;
+	if (mode == FileEntry::Header::LZ4HC_BLOCKS)
+		lz4_size_bound = BlocksCompressBound(uncompr_size);
+	else if (mode == FileEntry::Header::LZ4HC_STREAM)
+		lz4_size_bound = StreamCompressBound(uncompr_size);
+	else
+		lz4_size_bound = LZ4_compressBound(uncompr_size);
+
+	lz4_out_bound = Reserve(result.data, lz4_size_bound);
+	if (mode == FileEntry::Header::LZ4HC_BLOCKS)
+		lz4_size = LZ4_compress_blocks(context, builder.acceleration, buffer, uncompr_size, lz4_out_bound, lz4_size_bound);
+	else if (mode == FileEntry::Header::LZ4HC_STREAM)
+		lz4_size = LZ4_compress_stream(context, builder.acceleration, buffer, uncompr_size, lz4_out_bound, lz4_size_bound);
+	else
+		lz4_size = CompressBlock(context, builder.acceleration, buffer, uncompr_size, lz4_out_bound, lz4_size_bound);
+
+	uint32_t ratio = (uncompr_size / 2) + (uncompr_size / 4); // < 75% original size is ok
+	if (lz4_size > 0 && lz4_size < ratio)
+	{
+		result.compression = mode;
+		result.size = lz4_size;
+		if (mode == FileEntry::Header::LZ4HC || mode == FileEntry::Header::LZ4)
+			result.inplace_margin = InPlaceMargin(context, buffer, lz4_out_bound, result.size, uncompr_size);
+	}
+}
 
-	FileEntryBuilder() : compressed_data(NULL) {}
+struct SourceData
+{
+	size_t file;
+	unsigned char* buffer;
+	uint32_t size;
+	uint64_t hash;
+	uint64_t check;
 };
 
-struct FilePackerBuilder
+// Part of a large LZ4HC_BLOCKS file, compressed with its own block table.
+struct SegmentTask : Task
 {
-	std::vector<FileEntryBuilder> entries;
-	uint32_t current_offset;
+	std::vector<std::unique_ptr<CompressContext> >* contexts;
+	int acceleration;
+	const unsigned char* src;
+	uint32_t size;
+	std::vector<unsigned char> out;
 
-	FilePackerBuilder()
-		: current_offset(0) {}
+	void Run(unsigned worker)
+	{
+		out.resize(BlocksCompressBound(size));
+		out.resize(LZ4_compress_blocks(*(*contexts)[worker], acceleration, src, size, out.data(), (int) out.size()));
+	}
 };
 
-void WriteBuilder(FilePackerBuilder& builder, const std::string& base, const std::string& out_path)
+struct CompressTask : Task
 {
-	std::string out = out_path;
-	if (out.empty())
-		out = "a.out";
+	const FilePackerBuilder* builder;
+	std::vector<std::unique_ptr<CompressContext> >* contexts;
+	SourceData data;
+	size_t duplicate_of;
+	bool submitted;
+	CompressedFile result;
+	std::vector<std::unique_ptr<SegmentTask> > segments;
 
-	FILEPACKER_LOGV("\n -- Writing packed file system on %s --\n", out.c_str());
+	// Bytes held by the task until it is written, counted against the
+	// read budget.
+	uint64_t memory;
 
-	FilePackerHeader header;
-	header.Init();
-	header.file_count = (uint32_t) builder.entries.size();
+	void Run(unsigned worker)
+	{
+		CompressFile(*builder, *(*contexts)[worker], data.buffer, data.size, result);
+	}
+};
 
-	FILE* fout = fopen(out.c_str(), "wb+");
-	if (fout != NULL)
+void SubmitCompress(TaskPool& pool, CompressTask& task)
+{
+	if (SelectMode(*task.builder, task.data.size) != FileEntry::Header::LZ4HC_BLOCKS || task.data.size <= FilePackerBuilder::SegmentSize
+		|| CheckCompressibility(task.data.buffer, task.data.size) != COMPRESSIBLE)
 	{
-		fwrite((const void*)&header, sizeof(FilePackerHeader), 1, fout);
-		for (size_t i = 0; i < header.file_count; i++)
-		{
-			FileEntry& entry = builder.entries[i].entry;
-			fwrite(&entry.header, sizeof(entry.header), 1, fout);
-			size_t str_offset = 0;
-			uint32_t length = (uint32_t) entry.path.length();
-			if (length > FileEntry::MaxPathLength)
-			{
-				FILEPACKER_LOGE("WARNING: File %s is too long. Truncating.", entry.path.c_str());
-				str_offset = length - FileEntry::MaxPathLength;
-				length = FileEntry::MaxPathLength;
-			}
+		pool.Submit(&task);
+		return;
+	}
 
-			fwrite(&length, sizeof(length), 1, fout);
-			fwrite(entry.path.data() + str_offset, sizeof(char), length, fout);
-		}
+	for (uint32_t begin = 0; begin < task.data.size; begin += FilePackerBuilder::SegmentSize)
+	{
+		SegmentTask* segment = new SegmentTask();
+		segment->contexts = task.contexts;
+		segment->acceleration = task.builder->acceleration;
+		segment->src = task.data.buffer + begin;
+		segment->size = std::min(task.data.size - begin, (uint32_t) FilePackerBuilder::SegmentSize);
+		segment->cost = segment->size;
+		task.segments.push_back(std::unique_ptr<SegmentTask>(segment));
+		pool.Submit(segment);
+	}
+}
+
+// Most memory the compressed output of a submitted task can take: its
+// result buffer and, when split, the outputs of the segments as well.
+uint64_t OutputMemoryBound(const CompressTask& task)
+{
+	uint32_t size = task.data.size;
+	FileEntry::Header::Compression mode = SelectMode(*task.builder, size);
+	if (task.segments.empty())
+	{
+		if (size > LZ4_MAX_INPUT_SIZE)
+			return 0;
+		else if (mode == FileEntry::Header::LZ4HC_BLOCKS)
+			return BlocksCompressBound(size);
+		else if (mode == FileEntry::Header::LZ4HC_STREAM)
+			return StreamCompressBound(size);
+
+		return LZ4_COMPRESSBOUND(size);
+	}
+
+	uint64_t segments = 0;
+	for (size_t i = 0; i < task.segments.size(); i++)
+		segments += BlocksCompressBound(task.segments[i]->size);
 
-		for (size_t i = 0; i < header.file_count; i++)
+	return segments + size;
+}
+
+bool IsCompressed(TaskPool& pool, CompressTask& task)
+{
+	if (task.segments.empty())
+		return pool.IsDone(&task);
+
+	for (size_t i = 0; i < task.segments.size(); i++)
+	{
+		if (!pool.IsDone(task.segments[i].get()))
+			return false;
+	}
+
+	return true;
+}
+
+// Joins the block tables of the segments into the one of the entry. The
+// result is the same LZ4_compress_blocks gives for the whole file.
+void StitchSegments(CompressTask& task)
+{
+	// Files close to 4gb would overflow 32 bits in these sums.
+	uint32_t blocks = (uint32_t) (((uint64_t) task.data.size + FileEntry::BlockSize - 1) / FileEntry::BlockSize);
+	uint64_t total = (blocks + 1) * (uint64_t) sizeof(uint32_t);
+	for (size_t i = 0; i < task.segments.size(); i++)
+	{
+		const SegmentTask& segment = *task.segments[i];
+		uint32_t segment_blocks = (segment.size + FileEntry::BlockSize - 1) / FileEntry::BlockSize;
+		total += segment.out.size() - (segment_blocks + 1) * sizeof(uint32_t);
+	}
+
+	uint32_t ratio = (task.data.size / 2) + (task.data.size / 4); // < 75% original size is ok
+	if (total >= ratio)
+		return;
+
+	unsigned char* dst = Reserve(task.result.data, (size_t) total);
+	uint32_t written = (blocks + 1) * sizeof(uint32_t);
+	uint32_t block = 0;
+	for (size_t i = 0; i < task.segments.size(); i++)
+	{
+		const SegmentTask& segment = *task.segments[i];
+		uint32_t segment_blocks = (segment.size + FileEntry::BlockSize - 1) / FileEntry::BlockSize;
+		for (uint32_t j = 0; j < segment_blocks; j++, block++)
 		{
-			FileEntryBuilder& entrybuilder = builder.entries[i];
-			FileEntry& entry = builder.entries[i].entry;
-			FILEPACKER_LOGV(" - Writing %s\n", entry.path.c_str());
-			if (entrybuilder.compressed_data == NULL)
-			{
-				std::string full_path = base + "/" + entry.path;
-				FILE* file = fopen(full_path.c_str(), "rb");
-				char* buffer = new char[entry.header.size];
-				if (file != NULL)
-				{
-					fread(buffer, entry.header.size, 1, file);
-					fclose(file);
-				}
-				else
-				{
-					FILEPACKER_LOGE("ERROR: Unable to open %s while writing packaged file. Filling with dummy bytes.", full_path.c_str());
-					memset(buffer, 0, entry.header.size);
-				}
+			uint32_t begin, end;
+			memcpy(&begin, segment.out.data() + j * sizeof(uint32_t), sizeof(begin));
+			memcpy(&end, segment.out.data() + (j + 1) * sizeof(uint32_t), sizeof(end));
 
-				fwrite(buffer, entry.header.size, 1, fout);
-				delete[] buffer;
-			}
-			else
-			{
-				fwrite(entrybuilder.compressed_data, entry.header.size, 1, fout);
-				delete[] entrybuilder.compressed_data;
-				entrybuilder.compressed_data = NULL;
-			}
+			memcpy(dst + block * sizeof(uint32_t), &written, sizeof(written));
+			memcpy(dst + written, segment.out.data() + begin, end - begin);
+			written += end - begin;
 		}
 	}
+
+	memcpy(dst + blocks * sizeof(uint32_t), &written, sizeof(written));
+
+	task.result.compression = FileEntry::Header::LZ4HC_BLOCKS;
+	task.result.size = written;
+}
+
+void WaitCompressed(TaskPool& pool, CompressTask& task)
+{
+	if (task.segments.empty())
+	{
+		pool.Wait(&task);
+		return;
+	}
+
+	for (size_t i = 0; i < task.segments.size(); i++)
+		pool.Wait(task.segments[i].get());
+
+	StitchSegments(task);
+	task.segments.clear();
 }
 
-void BuildAddFile(FilePackerBuilder& builder, bool compress, const std::string& base, const std::string& path, const char* name)
+// Adds the next file in order, taking ownership of its buffer and of the
+// compressed data already made for it.
+void BuildAddFile(FilePackerBuilder& builder, bool compress, const std::string& path, const std::string& name, CompressTask& task)
 {
 	FileEntryBuilder entrybuilder;
 	FileEntry& entry = entrybuilder.entry;
-	entry.path = path + name;
-	std::string full_path = base + "/" + entry.path;
+	entrybuilder.path = path + name;
+	entry.header.uncompr_size = task.data.size;
+	unsigned char* buffer = task.data.buffer;
 
-	FILE* file = fopen(full_path.c_str(), "rb");
-	if (file != NULL)
+	// The hashes matched, but only the bytes can tell a duplicate from a
+	// collision, which is then compressed here like any other file.
+	if (task.duplicate_of != SIZE_MAX && !SameEntry(builder, task.duplicate_of, buffer, task.data.size))
 	{
-		fseek(file, 0, SEEK_END);
-		entry.header.uncompr_size = ftell(file);
+		FILEPACKER_LOGV(" - Hash collision of %s with %s\n", entrybuilder.path.c_str(), builder.entries[task.duplicate_of].path.c_str());
+		task.duplicate_of = SIZE_MAX;
+		if (CompressesAlone(builder, compress, task.data.size))
+			CompressFile(builder, builder.context, buffer, task.data.size, task.result);
+	}
 
-		fseek(file, 0, SEEK_SET);
-		unsigned char* buffer = new unsigned char[entry.header.uncompr_size];
-		fread(buffer, entry.header.uncompr_size, 1, file);
-		fclose(file);
+	if (task.duplicate_of != SIZE_MAX)
+	{
+		entrybuilder.duplicate_of = task.duplicate_of;
+		entry.header = builder.entries[task.duplicate_of].entry.header;
+		delete[] buffer;
+		builder.entries.push_back(entrybuilder);
+
+		FILEPACKER_LOGV(" - DUPLICATE: %s of %s\n", entrybuilder.path.c_str(), builder.entries[task.duplicate_of].path.c_str());
+		return;
+	}
+
+	unsigned char* crc_buffer = NULL;
+	if (compress && builder.solid_threshold > 0 && entry.header.uncompr_size < builder.solid_threshold)
+	{
+		AddSolidFile(builder, entry, buffer, path, name.c_str());
+		crc_buffer = buffer;
+	}
+	else if (compress && builder.dictionary_threshold > 0 && entry.header.uncompr_size < builder.dictionary_threshold)
+	{
+		entry.header.compression = FileEntry::Header::UNCOMPRESSED;
+		entry.header.size = entry.header.uncompr_size;
+		entry.header.inplace_margin = 0;
+		HoldForDictionary(builder, entrybuilder, buffer);
+		builder.entries.push_back(entrybuilder);
+		return;
+	}
+	else if (compress && builder.chunk_threshold > 0 && entry.header.uncompr_size >= builder.chunk_threshold)
+	{
+		std::vector<uint32_t> list;
+		uint32_t position = 0;
+		while (position < entry.header.uncompr_size)
+		{
+			uint32_t chunk_size = NextChunkSize(buffer + position, entry.header.uncompr_size - position);
+			list.push_back(AddChunk(builder, buffer + position, chunk_size));
+			position += chunk_size;
+		}
+
+		entry.header.compression = FileEntry::Header::CHUNKED;
+		entry.header.size = (uint32_t) (list.size() * sizeof(uint32_t));
+		entry.header.inplace_margin = 0;
+		entrybuilder.compressed_data = new unsigned char[entry.header.size];
+		memcpy(entrybuilder.compressed_data, list.data(), entry.header.size);
+		crc_buffer = entrybuilder.compressed_data;
+	}
+	else if (task.result.compression != FileEntry::Header::UNCOMPRESSED)
+	{
+		entry.header.compression = task.result.compression;
+		entry.header.size = task.result.size;
+		entry.header.inplace_margin = task.result.inplace_margin;
+		crc_buffer = task.result.data.data();
+	}
+	
+	if (task.result.compressibility != COMPRESSIBLE)
+	{
+		if (task.result.compressibility == KNOWN_FORMAT)
+			builder.stored_by_format++;
+		else
+			builder.stored_by_entropy++;
+
+		builder.stored_bytes += entry.header.uncompr_size;
+	}
+
+	if (crc_buffer == NULL)
+	{
+		entry.header.compression = FileEntry::Header::UNCOMPRESSED;
+		entry.header.size = entry.header.uncompr_size;
+		entry.header.inplace_margin = 0;
+		entrybuilder.compressed_data = NULL;
+		crc_buffer = buffer;
+	}
+		
+	// The chunk list alone would leave the chunks themselves unchecked.
+	const unsigned char* crc_data = crc_buffer;
+	uint32_t crc_size = entry.header.size;
+	if (entry.header.compression == FileEntry::Header::CHUNKED)
+	{
+		crc_data = buffer;
+		crc_size = entry.header.uncompr_size;
+	}
 
-		unsigned char* crc_buffer = NULL;
-		if (compress)
+	crcFast crc;
+	for (uint32_t i = 0; i < crc_size; i++)
+		crc.Append(crc_data[i]);
+
+	entry.header.crc = crc.CRC();
+	if (entry.header.compression != FileEntry::Header::SOLID)
+		entry.header.offset = WriteData(builder, crc_buffer, entry.header.size);
+
+	delete[] entrybuilder.compressed_data;
+	entrybuilder.compressed_data = NULL;
+	delete[] buffer;
+	entry.header.crc = crc.CRC();
+	builder.entries.push_back(entrybuilder);
+
+	entry.path = entrybuilder.path.c_str();
+	PrintFileEntry(entry);
+}
+
+// Trains the pack dictionary from the entries waiting for it and compresses
+// them, keeping the 75% rule of BuildAddFile.
+void CompressWithDictionary(FilePackerBuilder& builder)
+{
+	std::vector<size_t> pending;
+	std::vector<DictionarySample> samples;
+	uint32_t sampled = 0;
+	for (size_t i = 0; i < builder.entries.size(); i++)
+	{
+		FileEntryBuilder& entrybuilder = builder.entries[i];
+		if (!entrybuilder.dictionary_pending)
+			continue;
+
+		pending.push_back(i);
+		if (entrybuilder.compressed_data != NULL && sampled < FilePackerBuilder::MaxDictionarySamples)
 		{
-			unsigned char* lz4_out_bound = NULL;
-			int lz4_size = 0;
-			int lz4_size_bound = LZ4_compressBound(entry.header.uncompr_size);
-			lz4_out_bound = new unsigned char[lz4_size_bound];
-			lz4_size = LZ4_compress_HC((const char*)buffer, (char*)lz4_out_bound, entry.header.uncompr_size, lz4_size_bound, 9);
+			DictionarySample sample = { entrybuilder.compressed_data, entrybuilder.entry.header.uncompr_size };
+			samples.push_back(sample);
+			sampled += sample.size;
+		}
+	}
+
+	if (pending.empty())
+		return;
+
+	// The dictionary is stored uncompressed, so keep it well below the size
+	// of the files it serves.
+	uint32_t capacity = std::min((uint32_t) FilePackerBuilder::DictionarySize, sampled / 8);
+	builder.dictionary = TrainDictionary(samples, capacity);
+	FILEPACKER_LOGV(" - Trained %u bytes dictionary from %u files\n", (uint32_t) builder.dictionary.size(), (uint32_t) samples.size());
 
-			uint32_t ratio = (entry.header.uncompr_size / 2) + (entry.header.uncompr_size / 4); // < 75% original size is ok
-			if (lz4_size < ratio)
+	CompressContext& context = builder.context;
+	const char* dictionary = (const char*) builder.dictionary.data();
+	int dictionary_size = (int) builder.dictionary.size();
+	for (size_t i = 0; i < pending.size(); i++)
+	{
+		FileEntryBuilder& entrybuilder = builder.entries[pending[i]];
+		FileEntry& entry = entrybuilder.entry;
+		unsigned char* buffer = entrybuilder.compressed_data;
+		if (buffer == NULL)
+		{
+			buffer = new unsigned char[entry.header.uncompr_size];
+			entrybuilder.compressed_data = buffer;
+			if (Seek64(builder.spill, (int64_t) entrybuilder.spill_offset, SEEK_SET) != 0
+				|| fread(buffer, 1, entry.header.uncompr_size, builder.spill) != entry.header.uncompr_size)
 			{
-				entry.header.compression = FileEntry::Header::LZ4HC;
-				entry.header.size = lz4_size;
-				entrybuilder.compressed_data = new unsigned char[entry.header.size];
-				memcpy(entrybuilder.compressed_data, lz4_out_bound, entry.header.size);
-				crc_buffer = entrybuilder.compressed_data;
+				FILEPACKER_LOGE("ERROR: Unable to read %s back from the spill file.\n", entrybuilder.path.c_str());
+				builder.failed = true;
+				break;
 			}
+		}
+
+		int lz4_size_bound = LZ4_compressBound(entry.header.uncompr_size);
+		unsigned char* lz4_out_bound = Reserve(context.scratch, lz4_size_bound);
+		int lz4_size = 0;
+		if (builder.acceleration > 0)
+		{
+			LZ4_resetStream(context.fast_state);
+			if (dictionary_size > 0)
+				LZ4_loadDict(context.fast_state, dictionary, dictionary_size);
 
-			delete[] lz4_out_bound;
+			lz4_size = LZ4_compress_fast_continue(context.fast_state, (const char*) buffer, (char*) lz4_out_bound, entry.header.uncompr_size, lz4_size_bound, builder.acceleration);
 		}
-		
-		if (crc_buffer == NULL)
+		else
+		{
+			LZ4_resetStreamHC(context.state, 9);
+			if (dictionary_size > 0)
+				LZ4_loadDictHC(context.state, dictionary, dictionary_size);
+
+			lz4_size = LZ4_compress_HC_continue(context.state, (const char*) buffer, (char*) lz4_out_bound, entry.header.uncompr_size, lz4_size_bound);
+		}
+
+		const unsigned char* data = buffer;
+		uint32_t ratio = (entry.header.uncompr_size / 2) + (entry.header.uncompr_size / 4); // < 75% original size is ok
+		if (lz4_size > 0 && (uint32_t) lz4_size < ratio)
 		{
-			entry.header.compression = FileEntry::Header::UNCOMPRESSED;
-			entry.header.size = entry.header.uncompr_size;
-			entrybuilder.compressed_data = NULL;
-			crc_buffer = buffer;
+			entry.header.compression = FileEntry::Header::LZ4HC_DICT;
+			entry.header.size = lz4_size;
+			data = lz4_out_bound;
 		}
-			
+
 		crcFast crc;
-		for (uint32_t i = 0; i < entry.header.size; i++)
-			crc.Append(crc_buffer[i]);
+		for (uint32_t j = 0; j < entry.header.size; j++)
+			crc.Append(data[j]);
 
 		entry.header.crc = crc.CRC();
-		entry.header.offset = builder.current_offset;
-		builder.current_offset += entry.header.size;
-
+		entry.header.offset = WriteData(builder, data, entry.header.size);
 		delete[] buffer;
-		entry.header.crc = crc.CRC();
-		builder.entries.push_back(entrybuilder);
+		entrybuilder.compressed_data = NULL;
+		entrybuilder.dictionary_pending = false;
 
+		entry.path = entrybuilder.path.c_str();
 		PrintFileEntry(entry);
 	}
+
+	if (builder.spill != NULL)
+	{
+		fclose(builder.spill);
+		builder.spill = NULL;
+	}
 }
 
-void BuildFromPath(FilePackerBuilder& builder, bool compress, const std::string& base, const std::string& path)
+struct SourceFile
+{
+	std::string path;
+	std::string name;
+};
+
+void CollectFiles(std::vector<SourceFile>& files, const std::string& base, const std::string& path)
 {
 	tinydir_dir dir;
 	std::string full_path = base + "/" + path;
@@ -184,11 +1503,14 @@ void BuildFromPath(FilePackerBuilder& builder, bool compress, const std::string&
 			if (file.is_dir)
 			{
 				std::string newpath = path + file.name + "/";
-				BuildFromPath(builder, compress, base, newpath);
+				CollectFiles(files, base, newpath);
 			}
 			else if (file.is_reg)
 			{
-				BuildAddFile(builder, compress, base, path, file.name);
+				SourceFile source;
+				source.path = path;
+				source.name = file.name;
+				files.push_back(source);
 			}
 		}
 		else
@@ -201,11 +1523,280 @@ bail:
 	tinydir_close(&dir);
 }
 
+// Files read ahead of the compressor. Push blocks while the queued bytes
+// would go over the budget, unless the queue is empty, so a single file
+// larger than the budget still gets through.
+struct ReadQueue
+{
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::deque<SourceData> items;
+	uint64_t bytes;
+	uint64_t budget;
+	bool done;
+
+	bool cancelled;
+
+	explicit ReadQueue(uint64_t _budget) : bytes(0), budget(_budget), done(false), cancelled(false) {}
+
+	// Returns false, leaving data to the caller, once the queue is cancelled.
+	bool Push(const SourceData& data)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while (!items.empty() && bytes + data.size > budget && !cancelled)
+			changed.wait(lock);
+
+		if (cancelled)
+			return false;
+
+		items.push_back(data);
+		bytes += data.size;
+		changed.notify_all();
+		return true;
+	}
+
+	bool Pop(SourceData& data)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while (items.empty() && !done)
+			changed.wait(lock);
+
+		if (items.empty())
+			return false;
+
+		data = items.front();
+		items.pop_front();
+		bytes -= data.size;
+		changed.notify_all();
+		return true;
+	}
+
+	void Finish()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		done = true;
+		changed.notify_all();
+	}
+
+	// Stops the reader and drops the files it has queued.
+	void Cancel()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (size_t i = 0; i < items.size(); i++)
+			delete[] items[i].buffer;
+
+		items.clear();
+		bytes = 0;
+		cancelled = true;
+		changed.notify_all();
+	}
+};
+
+void ReadFiles(const std::vector<SourceFile>& files, const std::string& base, ReadQueue& queue)
+{
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		std::string full_path = base + "/" + files[i].path + files[i].name;
+		FILE* file = fopen(full_path.c_str(), "rb");
+		if (file == NULL)
+		{
+			FILEPACKER_LOGE("ERROR: Unable to open %s\n", full_path.c_str());
+			continue;
+		}
+
+		Seek64(file, 0, SEEK_END);
+		int64_t size = Tell64(file);
+		if (size < 0)
+		{
+			FILEPACKER_LOGE("ERROR: Unable to get the size of %s\n", full_path.c_str());
+			fclose(file);
+			continue;
+		}
+
+		if (size > UINT32_MAX)
+		{
+			FILEPACKER_LOGE("ERROR: %s is 4gb or larger, more than an entry can hold.\n", full_path.c_str());
+			fclose(file);
+			continue;
+		}
+
+		SourceData data;
+		data.file = i;
+		data.size = (uint32_t) size;
+		data.buffer = new unsigned char[data.size];
+
+		Seek64(file, 0, SEEK_SET);
+		bool read = data.size == 0 || fread(data.buffer, data.size, 1, file) == 1;
+		fclose(file);
+
+		if (!read)
+		{
+			FILEPACKER_LOGE("ERROR: Unable to read %s\n", full_path.c_str());
+			delete[] data.buffer;
+			continue;
+		}
+
+		data.hash = HashContent(data.buffer, data.size);
+		data.check = CheckContent(data.buffer, data.size);
+		if (!queue.Push(data))
+		{
+			delete[] data.buffer;
+			break;
+		}
+	}
+
+	queue.Finish();
+}
+
+// Reads files on a separate thread and compresses them on the pool, while the
+// calling thread writes them in order, so the pack is the same whatever the
+// thread count.
+void BuildFromPath(FilePackerBuilder& builder, bool compress, const std::string& base)
+{
+	std::vector<SourceFile> files;
+	CollectFiles(files, base, "");
+
+	// Half of the read budget for files waiting to be read by the pool, half
+	// for files being compressed or waiting to be written, along with their
+	// compressed output.
+	ReadQueue queue(builder.read_budget / 2);
+	std::thread reader(ReadFiles, std::cref(files), std::cref(base), std::ref(queue));
+
+	TaskPool pool(builder.threads);
+	std::vector<std::unique_ptr<CompressContext> > contexts;
+	for (unsigned i = 0; i < pool.ThreadCount(); i++)
+		contexts.push_back(std::unique_ptr<CompressContext>(new CompressContext()));
+
+	// Written tasks are kept for later files, so their output buffers are
+	// reused instead of allocated for every file.
+	std::vector<CompressTask*> spare;
+	uint64_t spare_bytes = 0;
+	std::deque<CompressTask*> inflight;
+	uint64_t inflight_bytes = 0;
+
+	SourceData data;
+	bool reading = true;
+	while (reading || !inflight.empty())
+	{
+		if (reading && queue.Pop(data))
+		{
+			CompressTask* task = NULL;
+			if (!spare.empty())
+			{
+				task = spare.back();
+				spare.pop_back();
+				spare_bytes -= task->result.data.size();
+			}
+			else
+			{
+				task = new CompressTask();
+			}
+
+			task->builder = &builder;
+			task->contexts = &contexts;
+			task->result.compression = FileEntry::Header::UNCOMPRESSED;
+			task->result.size = 0;
+			task->result.inplace_margin = 0;
+			task->result.compressibility = COMPRESSIBLE;
+			task->data = data;
+			task->cost = data.size;
+			task->duplicate_of = FindDuplicate(builder, data.hash, data.check, data.size);
+
+			// Entries are added in this same order, one per file read.
+			size_t entry = builder.entries.size() + inflight.size();
+			if (task->duplicate_of == SIZE_MAX)
+			{
+				ContentEntry content = { entry, data.size, data.check };
+				builder.contents.insert(std::make_pair(data.hash, content));
+			}
+
+			task->submitted = task->duplicate_of == SIZE_MAX && CompressesAlone(builder, compress, data.size);
+			// The input and whatever output buffer the task holds or may need.
+			// The buffer size is taken first, as the pool may grow it.
+			uint64_t output = task->result.data.size();
+			if (task->submitted)
+				SubmitCompress(pool, *task);
+
+			if (task->submitted)
+				output = std::max(output, OutputMemoryBound(*task));
+
+			task->memory = data.size + output;
+
+			inflight.push_back(task);
+			inflight_bytes += task->memory;
+		}
+		else
+		{
+			reading = false;
+		}
+
+		while (!inflight.empty() && (!reading || inflight_bytes + spare_bytes > builder.read_budget / 2 || !inflight.front()->submitted || IsCompressed(pool, *inflight.front())))
+		{
+			CompressTask* task = inflight.front();
+			inflight.pop_front();
+			inflight_bytes -= task->memory;
+
+			if (task->submitted)
+				WaitCompressed(pool, *task);
+
+			const SourceFile& file = files[task->data.file];
+			BuildAddFile(builder, compress, file.path, file.name, *task);
+			if (builder.failed && reading)
+			{
+				queue.Cancel();
+				reading = false;
+			}
+
+			if (spare.size() < pool.ThreadCount() * 2 && task->result.data.size() <= FilePackerBuilder::SegmentSize)
+			{
+				spare.push_back(task);
+				spare_bytes += task->result.data.size();
+			}
+			else
+			{
+				delete task;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < spare.size(); i++)
+		delete spare[i];
+
+	reader.join();
+}
+
 void BuildAndWrite(BuildParameters* params)
 {
 	FilePackerBuilder packer;
-	BuildFromPath(packer, params->compression != FileEntry::Header::UNCOMPRESSED, params->path, "");
-	WriteBuilder(packer, params->path, params->out);
+	packer.stream_threshold = params->stream_threshold;
+	packer.block_threshold = params->block_threshold;
+	packer.solid_threshold = params->solid_threshold;
+	packer.solid_grouping = params->solid_grouping;
+	packer.chunk_threshold = params->chunk_threshold;
+	packer.dictionary_threshold = params->dictionary_threshold;
+	packer.threads = params->threads;
+	packer.read_speed = params->read_speed;
+	packer.decode_scale = params->decode_scale > 0 ? params->decode_scale : 100;
+	if (params->compression == FileEntry::Header::LZ4)
+		packer.acceleration = params->acceleration > 0 ? params->acceleration : 1;
+	packer.SetMemoryLimit(params->memory_limit > 0 ? params->memory_limit : (uint64_t) FilePackerBuilder::DefaultMemoryLimit);
+	if (!OpenBuilder(packer, params->out))
+		return;
+
+	BuildFromPath(packer, params->compression != FileEntry::Header::UNCOMPRESSED, params->path);
+	if (!packer.failed)
+	{
+		FlushSolidGroups(packer);
+		CompressWithDictionary(packer);
+	}
+
+	WriteBuilder(packer);
+
+	if (packer.stored_by_format > 0 || packer.stored_by_entropy > 0)
+	{
+		FILEPACKER_LOGV(" - Stored without compressing: %u files of a compressed format, %u files with high entropy, %u KB\n",
+			packer.stored_by_format, packer.stored_by_entropy, (uint32_t) (packer.stored_bytes / 1024));
+	}
 }
 
 #ifdef _MSC_VER
@@ -240,11 +1831,12 @@ void Extract(ExtractParameters* extractparams)
 		auto it = fs.Entries().begin();
 		for (; it != fs.Entries().end(); it++)
 		{
-			const FileEntry& entry = it->second;
-			size_t found = entry.path.find_last_of("/\\");
+			const FileEntry& entry = *it;
+			std::string entry_path(entry.path);
+			size_t found = entry_path.find_last_of("/\\");
 			if (found != std::string::npos)
 			{
-				std::string path = entry.path.substr(0, found);
+				std::string path = entry_path.substr(0, found);
 				found = 0;
 				while (1)
 				{
@@ -272,21 +1864,23 @@ void Extract(ExtractParameters* extractparams)
 				}
 			}
 
-			unsigned char* buffer = new unsigned char[entry.header.uncompr_size];
-			fs.Read(entry, buffer);
+			unsigned char* buffer = new unsigned char[fs.InPlaceSize(entry)];
+			fs.ReadInPlace(entry, buffer);
 
 			std::string full_dir = out_path + "/" + entry.path;
 			FILE* f = fopen(full_dir.c_str(), "wb+");
 			if (f != NULL)
 			{
-				FILEPACKER_LOGV(" + Writing %s\n", entry.path.c_str());
+				FILEPACKER_LOGV(" + Writing %s\n", entry.path);
 				fwrite(buffer, 1, entry.header.uncompr_size, f);
 				fclose(f);
 			}
 			else
 			{
-				FILEPACKER_LOGE("ERROR: Unable to write %s\n", entry.path.c_str());
+				FILEPACKER_LOGE("ERROR: Unable to write %s\n", entry.path);
 			}
+
+			delete[] buffer;
 		}
 	}
 	else
@@ -303,8 +1897,8 @@ void List(const char* file)
 		auto it = fs.Entries().begin();
 		for (; it != fs.Entries().end(); it++)
 		{
-			const FileEntry& entry = it->second;
-			FILEPACKER_LOGV("%s\n", entry.path.c_str());
+			const FileEntry& entry = *it;
+			FILEPACKER_LOGV("%s\n", entry.path);
 		}
 	}
 	else
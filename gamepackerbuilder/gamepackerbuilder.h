@@ -6,9 +6,70 @@ namespace gpack
 {
 	struct BuildParameters
 	{
+		enum SolidGrouping
+		{
+			SOLID_BY_DIRECTORY,
+			SOLID_BY_EXTENSION
+		};
+
 		const char* path;
 		const char* out;
+
+		// UNCOMPRESSED, LZ4HC or LZ4. LZ4 compresses every file with LZ4 fast
+		// at the given acceleration, 1 if 0, building much faster for
+		// development at the cost of a larger pack.
 		FileEntry::Header::Compression compression;
+		int acceleration;
+		uint32_t stream_threshold;
+		uint32_t block_threshold;
+
+		// Files smaller than solid_threshold are compressed together in
+		// solid blocks, one open block per directory or per extension.
+		uint32_t solid_threshold;
+		SolidGrouping solid_grouping;
+
+		// Files of at least chunk_threshold bytes are split in content
+		// defined chunks, each one stored once in the pack.
+		uint32_t chunk_threshold;
+
+		// Files smaller than dictionary_threshold are compressed against a
+		// dictionary trained from them and stored once in the pack.
+		uint32_t dictionary_threshold;
+
+		// Bytes the builder may keep in memory: files read ahead, open solid
+		// blocks and files waiting for the dictionary, which spill to a
+		// temporary file past their share. 0 uses a default of 256mb.
+		uint64_t memory_limit;
+
+		// Compression threads, 0 uses one per hardware thread. The pack is
+		// the same for any count, unless read_speed is set.
+		unsigned threads;
+
+		// With a read_speed, in mb/s, files compressed on their own as a
+		// single block are stored, or compressed with LZ4 or one of several
+		// LZ4HC levels, whichever loads fastest: the read time at that speed
+		// plus the decode time measured while building, scaled by
+		// decode_scale percent for a target slower (above 100) or faster
+		// than the build machine. 0 keeps the 75% rule.
+		uint32_t read_speed;
+		uint32_t decode_scale;
+
+		BuildParameters()
+			: path(NULL)
+			, out(NULL)
+			, compression(FileEntry::Header::UNCOMPRESSED)
+			, acceleration(0)
+			, stream_threshold(0)
+			, block_threshold(0)
+			, solid_threshold(0)
+			, solid_grouping(SOLID_BY_DIRECTORY)
+			, chunk_threshold(0)
+			, dictionary_threshold(0)
+			, memory_limit(0)
+			, threads(0)
+			, read_speed(0)
+			, decode_scale(0)
+		{}
 	};
 
 	void BuildAndWrite(BuildParameters* params);
@@ -0,0 +1,124 @@
+#include "taskpool.h"
+
+#include <algorithm>
+
+namespace gpack
+{
+
+TaskPool::TaskPool(unsigned _threads)
+	: next(0)
+	, pending(0)
+	, stop(false)
+{
+	if (_threads == 0)
+		_threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+	for (unsigned i = 0; i < _threads; i++)
+		workers.push_back(std::unique_ptr<Worker>(new Worker()));
+
+	for (unsigned i = 0; i < _threads; i++)
+		threads.push_back(std::thread(&TaskPool::Run, this, (size_t) i));
+}
+
+TaskPool::~TaskPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+
+	wake.notify_all();
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+}
+
+void TaskPool::Submit(Task* task)
+{
+	task->done = false;
+
+	Worker& worker = *workers[next++ % workers.size()];
+	{
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		auto it = std::upper_bound(worker.tasks.begin(), worker.tasks.end(), task, [](const Task* a, const Task* b) {
+			return a->cost > b->cost;
+		});
+
+		worker.tasks.insert(it, task);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pending++;
+	}
+
+	wake.notify_one();
+}
+
+bool TaskPool::IsDone(Task* task)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return task->done;
+}
+
+void TaskPool::Wait(Task* task)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!task->done)
+		finished.wait(lock);
+}
+
+unsigned TaskPool::ThreadCount() const
+{
+	return (unsigned) threads.size();
+}
+
+Task* TaskPool::Take(size_t worker)
+{
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		Worker& victim = *workers[(worker + i) % workers.size()];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.tasks.empty())
+		{
+			Task* task = victim.tasks.front();
+			victim.tasks.pop_front();
+			return task;
+		}
+	}
+
+	return NULL;
+}
+
+void TaskPool::Run(size_t worker)
+{
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (pending == 0 && !stop)
+				wake.wait(lock);
+
+			if (pending == 0)
+				return;
+
+			pending--;
+		}
+
+		// Every pending count matches a queued task, but it may be taken
+		// from another queue while walking them, so keep looking.
+		Task* task = NULL;
+		while (task == NULL)
+			task = Take(worker);
+
+		task->Run((unsigned) worker);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			task->done = true;
+		}
+
+		finished.notify_all();
+	}
+}
+
+} // namespace gpack
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace gpack
+{
+	struct Task
+	{
+		// Tasks with a bigger cost are run first.
+		uint64_t cost;
+
+		Task() : cost(0), done(false) {}
+		virtual ~Task() {}
+
+		// worker is the index, below ThreadCount(), of the thread running
+		// the task, for tasks that keep per thread state.
+		virtual void Run(unsigned worker) = 0;
+
+	private:
+		friend struct TaskPool;
+		bool done;
+	};
+
+	// Fixed set of worker threads. Every worker has its own queue, kept in
+	// largest cost first order, and a worker with an empty queue steals the
+	// largest task of the others, so long tasks start early and no thread
+	// sits idle while work is left.
+	struct TaskPool
+	{
+		// 0 threads uses one per hardware thread.
+		explicit TaskPool(unsigned threads = 0);
+		~TaskPool();
+
+		// A task can be submitted again once it is done.
+		void Submit(Task* task);
+		bool IsDone(Task* task);
+		void Wait(Task* task);
+
+		unsigned ThreadCount() const;
+
+	private:
+		struct Worker
+		{
+			std::mutex mutex;
+			std::deque<Task*> tasks;
+		};
+
+		Task* Take(size_t worker);
+		void Run(size_t worker);
+
+		std::vector<std::unique_ptr<Worker> > workers;
+		std::vector<std::thread> threads;
+		size_t next;
+
+		std::mutex mutex;
+		std::condition_variable wake;
+		std::condition_variable finished;
+		size_t pending;
+		bool stop;
+	};
+}
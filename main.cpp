@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string>
 
 #include "gamepacker.h"
@@ -19,6 +20,28 @@ void PrintUsage()
 		   "                        - If --input, specifies build file path.\n"
 		   "                        - If --output, specifies output dir path.\n"
 		   "  -c, --compress       Enables compression while building.\n"
+		   "  -f, --fast [n]       Compresses with LZ4 fast at acceleration n, 1 for the\n"
+		   "                       best ratio, instead of LZ4HC. Much quicker to build,\n"
+		   "                       for development packs.\n"
+		   "  -s, --stream [kb]    Compresses files of at least the given size as a\n"
+		   "                       stream of 64kb blocks, readable with bounded memory.\n"
+		   "  -b, --blocks [kb]    Compresses files of at least the given size as\n"
+		   "                       independent 64kb blocks, allowing random access.\n"
+		   "                       Files over 4mb default to it, on several threads.\n"
+		   "  -m, --solid [kb]     Compresses files smaller than the given size together\n"
+		   "                       in shared solid blocks.\n"
+		   "  --solid-by [dir|ext] Groups solid files by directory (default) or by\n"
+		   "                       extension.\n"
+		   "  -k, --chunk [kb]     Splits files of at least the given size in content\n"
+		   "                       defined chunks, storing repeated chunks once.\n"
+		   "  -d, --dict [kb]      Compresses files smaller than the given size with a\n"
+		   "                       dictionary trained from them.\n"
+		   "  --memory [mb]        Memory the build may use, 256mb by default.\n"
+		   "  -j, --threads [n]    Compression threads, one per core by default.\n"
+		   "  --read-speed [mb/s]  Picks for each file storing it, LZ4 or a LZ4HC level,\n"
+		   "                       whichever loads fastest reading at the given speed.\n"
+		   "  --decode-scale [%%]   Decode time of the target relative to this machine,\n"
+		   "                       100%% by default. Used with --read-speed.\n"
 		   "  -t, --test [file]    Check if CRC files match with data file.\n"
 		   "  -x, --extract [file] Extract given file to a directory. If out directory is\n"
 		   "                       not given, extract in current working directory.\n"
@@ -45,10 +68,32 @@ struct Parameters
 	std::string op_param;
 	std::string out_path;
 	bool compress;
+	int acceleration;
+	uint32_t stream_threshold;
+	uint32_t block_threshold;
+	uint32_t solid_threshold;
+	bool solid_by_extension;
+	uint32_t chunk_threshold;
+	uint32_t dictionary_threshold;
+	uint64_t memory_limit;
+	unsigned threads;
+	uint32_t read_speed;
+	uint32_t decode_scale;
 
 	Parameters()
 		: op_id(Operation::NONE)
 		, compress(false)
+		, acceleration(0)
+		, stream_threshold(0)
+		, block_threshold(0)
+		, solid_threshold(0)
+		, solid_by_extension(false)
+		, chunk_threshold(0)
+		, dictionary_threshold(0)
+		, memory_limit(0)
+		, threads(0)
+		, read_speed(0)
+		, decode_scale(0)
 	{}
 };
 
@@ -64,7 +109,21 @@ void ExecuteParams(const Parameters* params)
 		gpack::BuildParameters buildparams;
 		buildparams.path = params->op_param.c_str();
 		buildparams.out = params->out_path.c_str();
-		buildparams.compression = params->compress ? gpack::FileEntry::Header::LZ4HC : gpack::FileEntry::Header::UNCOMPRESSED;
+		buildparams.compression = gpack::FileEntry::Header::UNCOMPRESSED;
+		if (params->compress)
+			buildparams.compression = params->acceleration > 0 ? gpack::FileEntry::Header::LZ4 : gpack::FileEntry::Header::LZ4HC;
+
+		buildparams.acceleration = params->acceleration;
+		buildparams.stream_threshold = params->stream_threshold;
+		buildparams.block_threshold = params->block_threshold;
+		buildparams.solid_threshold = params->solid_threshold;
+		buildparams.solid_grouping = params->solid_by_extension ? gpack::BuildParameters::SOLID_BY_EXTENSION : gpack::BuildParameters::SOLID_BY_DIRECTORY;
+		buildparams.chunk_threshold = params->chunk_threshold;
+		buildparams.dictionary_threshold = params->dictionary_threshold;
+		buildparams.memory_limit = params->memory_limit;
+		buildparams.threads = params->threads;
+		buildparams.read_speed = params->read_speed;
+		buildparams.decode_scale = params->decode_scale;
 		gpack::BuildAndWrite(&buildparams);
 
 		break;
@@ -168,6 +227,197 @@ int main(int argc, char** argv)
 			params.compress = true;
 			argn += 1;
 		}
+		else if (strcmp(argv[argn], "--fast") == 0 || strcmp(argv[argn], "-f") == 0)
+		{
+			if (params.acceleration != 0)
+			{
+				printf("Error: %s. Acceleration already defined.\n", argv[argn]);
+				return -1;
+			}
+
+			if ((argn + 1) >= argc)
+			{
+				printf("Error: operation %s expects one more parameter.\n", argv[argn]);
+				return -1;
+			}
+
+			params.acceleration = atoi(argv[argn + 1]);
+			params.compress = true;
+			argn += 2;
+		}
+		else if (strcmp(argv[argn], "--stream") == 0 || strcmp(argv[argn], "-s") == 0)
+		{
+			if (params.stream_threshold != 0)
+			{
+				printf("Error: %s. Stream threshold already defined.\n", argv[argn]);
+				return -1;
+			}
+
+			if ((argn + 1) >= argc)
+			{
+				printf("Error: operation %s expects one more parameter.\n", argv[argn]);
+				return -1;
+			}
+
+			params.stream_threshold = (uint32_t) atoi(argv[argn + 1]) * 1024;
+			argn += 2;
+		}
+		else if (strcmp(argv[argn], "--blocks") == 0 || strcmp(argv[argn], "-b") == 0)
+		{
+			if (params.block_threshold != 0)
+			{
+				printf("Error: %s. Block threshold already defined.\n", argv[argn]);
+				return -1;
+			}
+
+			if ((argn + 1) >= argc)
+			{
+				printf("Error: operation %s expects one more parameter.\n", argv[argn]);
+				return -1;
+			}
+
+			params.block_threshold = (uint32_t) atoi(argv[argn + 1]) * 1024;
+			argn += 2;
+		}
+		else if (strcmp(argv[argn], "--solid") == 0 || strcmp(argv[argn], "-m") == 0)
+		{
+			if (params.solid_threshold != 0)
+			{
+				printf("Error: %s. Solid threshold already defined.\n", argv[argn]);
+				return -1;
+			}
+
+			if ((argn + 1) >= argc)
+			{
+				printf("Error: operation %s expects one more parameter.\n", argv[argn]);
+				return -1;
+			}
+
+			params.solid_threshold = (uint32_t) atoi(argv[argn + 1]) * 1024;
+			argn += 2;
+		}
+		else if (strcmp(argv[argn], "--chunk") == 0 || strcmp(argv[argn], "-k") == 0)
+		{
+			if (params.chunk_threshold != 0)
+			{
+				printf("Error: %s. Chunk threshold already defined.\n", argv[argn]);
+				return -1;
+			}
+
+			if ((argn + 1) >= argc)
+			{
+				printf("Error: operation %s expects one more parameter.\n", argv[argn]);
+				return -1;
+			}
+
+			params.chunk_threshold = (uint32_t) atoi(argv[argn + 1]) * 1024;
+			argn += 2;
+		}
+		else if (strcmp(argv[argn], "--dict") == 0 || strcmp(argv[argn], "-d") == 0)
+		{
+			if (params.dictionary_threshold != 0)
+			{
+				printf("Error: %s. Dictionary threshold already defined.\n", argv[argn]);
+				return -1;
+			}
+
+			if ((argn + 1) >= argc)
+			{
+				printf("Error: operation %s expects one more parameter.\n", argv[argn]);
+				return -1;
+			}
+
+			params.dictionary_threshold = (uint32_t) atoi(argv[argn + 1]) * 1024;
+			argn += 2;
+		}
+		else if (strcmp(argv[argn], "--memory") == 0)
+		{
+			if (params.memory_limit != 0)
+			{
+				printf("Error: %s. Memory limit already defined.\n", argv[argn]);
+				return -1;
+			}
+
+			if ((argn + 1) >= argc)
+			{
+				printf("Error: operation %s expects one more parameter.\n", argv[argn]);
+				return -1;
+			}
+
+			params.memory_limit = (uint64_t) atoi(argv[argn + 1]) * 1024 * 1024;
+			argn += 2;
+		}
+		else if (strcmp(argv[argn], "--threads") == 0 || strcmp(argv[argn], "-j") == 0)
+		{
+			if (params.threads != 0)
+			{
+				printf("Error: %s. Thread count already defined.\n", argv[argn]);
+				return -1;
+			}
+
+			if ((argn + 1) >= argc)
+			{
+				printf("Error: operation %s expects one more parameter.\n", argv[argn]);
+				return -1;
+			}
+
+			params.threads = (unsigned) atoi(argv[argn + 1]);
+			argn += 2;
+		}
+		else if (strcmp(argv[argn], "--read-speed") == 0)
+		{
+			if (params.read_speed != 0)
+			{
+				printf("Error: %s. Read speed already defined.\n", argv[argn]);
+				return -1;
+			}
+
+			if ((argn + 1) >= argc)
+			{
+				printf("Error: operation %s expects one more parameter.\n", argv[argn]);
+				return -1;
+			}
+
+			params.read_speed = (uint32_t) atoi(argv[argn + 1]);
+			argn += 2;
+		}
+		else if (strcmp(argv[argn], "--decode-scale") == 0)
+		{
+			if (params.decode_scale != 0)
+			{
+				printf("Error: %s. Decode scale already defined.\n", argv[argn]);
+				return -1;
+			}
+
+			if ((argn + 1) >= argc)
+			{
+				printf("Error: operation %s expects one more parameter.\n", argv[argn]);
+				return -1;
+			}
+
+			params.decode_scale = (uint32_t) atoi(argv[argn + 1]);
+			argn += 2;
+		}
+		else if (strcmp(argv[argn], "--solid-by") == 0)
+		{
+			if ((argn + 1) >= argc)
+			{
+				printf("Error: operation %s expects one more parameter.\n", argv[argn]);
+				return -1;
+			}
+
+			if (strcmp(argv[argn + 1], "ext") == 0)
+			{
+				params.solid_by_extension = true;
+			}
+			else if (strcmp(argv[argn + 1], "dir") != 0)
+			{
+				printf("Error: %s expects dir or ext.\n", argv[argn]);
+				return -1;
+			}
+
+			argn += 2;
+		}
 		else if (strcmp(argv[argn], "--extract") == 0 || strcmp(argv[argn], "-x") == 0)
 		{
 			if (params.compress)